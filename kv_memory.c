@@ -8,6 +8,10 @@ void *kv_dma_malloc(size_t size) { return spdk_dma_malloc(size, 4, NULL); }
 
 void *kv_dma_zmalloc(size_t size) { return spdk_dma_zmalloc(size, 4, NULL); }
 
+void *kv_dma_zmalloc_align(size_t size, size_t align) {
+  return spdk_dma_zmalloc(size, align, NULL);
+}
+
 void kv_dma_free(void *buf) { spdk_dma_free(buf); }
 
 struct _kv_mempool {
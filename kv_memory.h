@@ -15,6 +15,7 @@
 
 void *kv_dma_malloc(size_t size);
 void *kv_dma_zmalloc(size_t size);
+void *kv_dma_zmalloc_align(size_t size, size_t align);
 void kv_dma_free(void *buf);
 struct kv_mempool;
 struct kv_mempool *kv_mempool_create(size_t count, size_t ele_size);
@@ -11,14 +11,18 @@
 #include <string.h>
 #include <sys/cdefs.h>
 #include <sys/queue.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "kv_app.h"
 #include "kv_memory.h"
-#include "uthash.h"
+#include "kv_timer.h"
 
 #define TIMEOUT_IN_MS (500U)
 #define MAX_Q_NUM (4096U)
+#define MAX_CONN_NUM (4096U)
+#define MAX_REQ_NUM (8191U) // outstanding requests per client connection
+#define MAX_RD_ATOMIC (16U)
 
 #define TEST_NZ(x)                                                             \
   do {                                                                         \
@@ -30,23 +34,131 @@
   } while (0)
 #define TEST_Z(x) TEST_NZ(!(x))
 
+// a request id holds the index of the request ctx and its generation, which
+// changes each time the ctx is released, so a late response never completes a
+// recycled ctx.
+#define REQ_INDEX_BITS (13U) // MAX_REQ_NUM < 1 << REQ_INDEX_BITS
+#define REQ_GEN_MASK (0x7FFU)
+#define REQ_ID(index, gen)                                                     \
+  ((((uint32_t)(gen)&REQ_GEN_MASK) << REQ_INDEX_BITS) | (index))
+#define REQ_INDEX(id) ((id) & ((1U << REQ_INDEX_BITS) - 1))
+#define REQ_GEN(id) (((id) >> REQ_INDEX_BITS) & REQ_GEN_MASK)
 struct req_header {
   uint64_t resp_addr;
   uint32_t req_id;
+  uint16_t conn_slot; // index of the server connection in its slot table
+  uint16_t flags;
+// the payload is a rndv_desc, the server pulls the request with RDMA READ.
+#define REQ_RNDV (1U << 0)
+// a one-way message, the server makes no response.
+#define REQ_ONEWAY (1U << 1)
+// a stream request, followed by a stream_desc. resp_addr is the ring.
+#define REQ_STREAM (1U << 2)
+// acknowledges the slots of the stream req_id consumed, resp_addr is their
+// total count. it takes no credit and carries no payload.
+#define REQ_STREAM_ACK (1U << 3)
+// asks for the directory of exported regions, sent by the library on connect.
+// the payload is the number of regions the response may hold.
+#define REQ_DIRECTORY (1U << 4)
 #define HEADER_SIZE (sizeof(struct req_header))
 } __attribute__((packed));
 
+// rendezvous descriptor of a request too large for the server's receive
+// buffers, sent in place of the payload.
+struct rndv_desc {
+  uint32_t len; // total payload length
+  uint32_t sge_num;
+  struct {
+    uint64_t addr;
+    uint32_t rkey;
+    uint32_t length;
+  } __attribute__((packed)) sges[KV_RDMA_MAX_SGE];
+} __attribute__((packed));
+#define RNDV_DESC_SIZE(n) (8 + 16 * (n))
+
+// the ring of a stream request, sent after the payload.
+struct stream_desc {
+  uint32_t slot_sz;
+  uint32_t slot_num;
+} __attribute__((packed));
+#define STREAM_DESC_SIZE (sizeof(struct stream_desc))
+
+// sent by the server along with rdma_accept.
+struct conn_private_data {
+  uint32_t conn_slot;
+  uint32_t max_msg_sz;  // size of the server's receive buffers
+  uint32_t max_rndv_sz; // largest request accepted through rendezvous
+  uint32_t credits;     // requests the client may have outstanding
+  uint32_t export_num;  // regions exported, 0 skips the directory request
+} __attribute__((packed));
+
+// immediate data of a response: [31] last chunk of a stream, [30] chunk of a
+// stream, [29:24] credits returned to the client, [23:0] index of the request
+// ctx.
+#define IMM_LAST (1U << 31)
+#define IMM_STREAM (1U << 30)
+#define IMM_MAX_CREDITS (0x3FU)
+#define IMM_MAKE(credits, id) (((uint32_t)(credits) << 24) | (id))
+#define IMM_CREDITS(imm) (((imm) >> 24) & IMM_MAX_CREDITS)
+#define IMM_ID(imm) ((imm) & 0xFFFFFFU)
+// the id of a zero-length write which only returns credits, its index is out
+// of the ctx pool.
+#define IMM_CREDIT_ONLY (0xFFFFFFU)
+
+// the low bits of a wr_id tell what it points to: a server_req_ctx of the srq
+// (0), a ud receive (UD_WR_SERVER or UD_WR_CLIENT), a client connection for
+// the receives of its ring, or an sq_entry for a send. the opcode of an error
+// completion is undefined, it is routed by them instead.
+#define WR_KIND (7U)
+#define WR_RING (3U)
+#define WR_SEND (4U)
+
+// every send-side WR of a connection takes one entry of its send queue. only
+// one out of signal_interval WRs is signaled, and its completion reclaims all
+// the entries posted since the previous signaled WR.
+#define MAX_SIGNAL_INTERVAL (128U)
+typedef void (*sq_done_cb)(void *ctx, bool success);
+struct sq_entry {
+  struct rdma_connection *conn;
+  uint32_t first, seq;
+  sq_done_cb done;
+  void *ctx;
+};
+struct send_queue {
+  pthread_spinlock_t lock;
+  uint32_t head;       // seq of the next WR
+  uint32_t signal_seq; // seq of the first WR not covered by a signaled WR
+  uint32_t idle_mark;  // head observed by the last idle check
+  uint32_t completed;  // number of reclaimed WRs, updated atomically
+  struct sq_entry *entries;
+};
+
 struct rdma_connection {
   struct kv_rdma *self;
   struct rdma_cm_id *cm_id;
   struct ibv_qp *qp;
+  uint32_t qp_num;
   bool is_server;
+  bool closing; // set once the cm poller has torn its qp down
+  struct rdma_device *dev; // the device of cm_id, set with the qp
+  uint32_t thread; // index of the cq poller owning the qp
+  uint32_t max_sge;
+  uint32_t max_inline; // payloads up to this size are posted inline
+  struct send_queue sq;
   union {
     // server connection data
     struct {
       kv_rdma_req_handler handler;
       void *arg;
-      UT_hash_handle hh;
+      uint32_t slot;
+      uint32_t owed; // credits to return to the client, updated atomically
+      uint32_t msg_owed; // same, for the one-way messages
+      uint32_t ack_owed; // same, for the acknowledgements of live streams
+      // the connection itself and the requests it holds, updated atomically.
+      // the qp is only torn down once they are all done with.
+      uint32_t refs;
+      pthread_spinlock_t stream_lock;
+      LIST_HEAD(, server_req_ctx) streams; // not ended yet
     } s;
     // client connection data
     struct {
@@ -55,13 +167,161 @@ struct rdma_connection {
       kv_rdma_disconnect_cb disconnect;
       void *disconnect_arg;
       struct kv_mempool *mp;
+      uint32_t ctx_sz; // ctxs are followed by room for inline payloads
+      struct ibv_mr *mp_mr; // the rendezvous descriptors live in the ctxs
+      struct kv_mempool *rw_mp; // one-sided ops, bounded by the send queue
+      struct conn_private_data peer;
+      // a request takes one credit of the server, and responses carry back
+      // the credits of the requests the server is done with.
+      pthread_spinlock_t lock;
+      uint32_t credits;
+      STAILQ_HEAD(, client_req_ctx) pending;
+      // streams whose acknowledgement waits for a credit.
+      STAILQ_HEAD(, client_req_ctx) acks;
+      uint32_t outstanding; // requests not completed yet, updated atomically
+      uint32_t recv_used; // receives consumed and not reposted yet
+      struct ud_client *ud; // NULL for an rc connection
+      // under the lock, slots of all the rings of the streams not ended.
+      LIST_HEAD(, client_req_ctx) streams;
+      uint32_t stream_slots;
+      struct kv_rdma_region *regions; // the directory of the server
+      uint32_t region_num;
     } c;
   } u;
 };
+// srq receives freed while a cq poller runs are chained and posted with one
+// ibv_post_srq_recv at the end of its poll batch.
+#define MAX_SRQ_BATCH (128U)
+struct srq_batch {
+  struct ibv_recv_wr wrs[MAX_SRQ_BATCH];
+  struct ibv_sge sges[MAX_SRQ_BATCH];
+  uint32_t num;
+};
+// responses made while a cq poller runs are staged and posted with one
+// chained ibv_post_send per qp at the end of its poll batch, or earlier once
+// MAX_RESP_BATCH are staged or the oldest has waited resp_delay_us.
+#define MAX_RESP_BATCH (32U)
+struct resp_batch {
+  struct ibv_send_wr wrs[MAX_RESP_BATCH];
+  struct ibv_sge sges[MAX_RESP_BATCH][KV_RDMA_MAX_SGE];
+  struct server_req_ctx *ctxs[MAX_RESP_BATCH];
+  uint32_t num;
+  uint64_t since_us; // when the oldest response was staged
+};
+// each cq poller polls its own cq, the completions of a qp are always handled
+// by the thread of the poller owning it.
 struct cq_poller_ctx {
   struct kv_rdma *self;
+  struct rdma_device *dev;
   struct ibv_cq *cq;
   void *poller;
+  struct srq_batch srq;
+  struct resp_batch resp;
+  // deadlines of the requests of the connections owned by this poller, in
+  // ms. requests may be sent from any thread, hence the lock.
+  pthread_spinlock_t timer_lock;
+  struct kv_timer_wheel wheel;
+  // hybrid mode: after idle_spin_us without completions the cq is armed and
+  // the poller becomes a timed one, waiting for an event of the channel.
+  struct ibv_comp_channel *channel;
+  uint64_t idle_since; // in us, 0 while completions keep coming
+  bool armed, sleeping;
+  struct ud_endpoint *ud; // the server's ud qp polled by this thread
+};
+// the cq poller running on this thread, if any.
+static __thread struct cq_poller_ctx *polling;
+// counters are kept per kv_app thread and summed up by kv_rdma_get_stats.
+struct rdma_stats {
+  uint64_t reqs, inline_reqs, rndv_reqs, credit_waits;
+  uint64_t timeouts, stale_resps;
+  uint64_t cq_sleeps;
+  uint64_t resps, inline_resps, resp_doorbells;
+  uint64_t ud_retransmits;
+  uint64_t ring_flushes;
+} __attribute__((aligned(64)));
+#define STATS(self) ((self)->stats + kv_app_get_thread_index())
+// every buffer is registered on all the devices, so that it can be used on
+// any connection. the handle given to the user starts with a copy of the
+// ibv_mr of the first device narrowed to the buffer, and regs holds the
+// registrations of all the devices, NULL terminated. kind tells which
+// allocator a handle comes from, so that it is given back to the right one.
+enum rdma_mr_kind { MR_BULK, MR_SLAB, MR_REG };
+struct rdma_mr {
+  struct ibv_mr mr;
+  struct ibv_mr **regs;
+  uint8_t kind;
+};
+// registrations of application memory, kept in a treap ordered by start
+// address and augmented with the largest end of each subtree so the region
+// covering a range is found in O(log n). an entry starts with a copy of its
+// ibv_mr, which is the handle given to the user. unreferenced entries stay
+// registered on a lru list until evicted.
+struct reg_entry {
+  struct rdma_mr mr;
+  uintptr_t start, end, max_end;
+  uint32_t prio;
+  uint32_t ref;
+  bool cached; // still in the treap, cleared by invalidation
+  struct reg_entry *left, *right;
+  struct reg_entry *next; // links the entries collected by invalidation
+  TAILQ_ENTRY(reg_entry) lru;
+};
+struct reg_cache {
+  pthread_mutex_t lock; // held across treap updates, never across verbs calls
+  struct reg_entry *root;
+  TAILQ_HEAD(, reg_entry) lru;
+  uint32_t idle_num, max_idle;
+  uint32_t seed;
+  uint64_t hits, misses, evictions;
+};
+// kv_rdma_alloc_req/alloc_resp carve buffers out of registered regions, one
+// per access class so that request buffers are never remotely writable. a
+// region is split into chunks, each dedicated to a power-of-two size class
+// on first use. freed buffers go to the free list of the calling thread, and
+// move in batches through a shared list per class.
+#define SLAB_MIN_SHIFT (7U)    // 128B
+#define SLAB_CHUNK_SHIFT (20U) // 1MiB, also the largest class
+#define SLAB_CLASS_NUM (SLAB_CHUNK_SHIFT - SLAB_MIN_SHIFT + 1)
+#define SLAB_BATCH (32U)
+#define SLAB_LARGE (0xFFU)
+#define SLAB_REQ (0U)  // read by the server on rendezvous
+#define SLAB_RESP (1U) // written by the server
+#define SLAB_NUM (2U)
+struct slab_buf {
+  struct rdma_mr mr; // narrowed to the buffer, the handle given to the user
+  struct slab *slab;
+  struct slab_buf *next;
+  uint8_t cls; // SLAB_LARGE for a buffer with its own registrations
+};
+struct slab_list {
+  struct slab_buf *head;
+  uint32_t num;
+};
+struct slab {
+  struct kv_rdma *self;
+  pthread_spinlock_t lock;
+  size_t size;
+  int access;
+  struct ibv_mr **regs; // registered on first use
+  uint8_t *buf;
+  struct slab_buf **chunks; // descriptors of the carved chunks
+  uint32_t chunk_num, chunk_used;
+  struct slab_list shared[SLAB_CLASS_NUM];
+  struct {
+    struct slab_list l[SLAB_CLASS_NUM];
+  } __attribute__((aligned(64))) local[MAX_TASKS_NUM];
+};
+// receive buffers added to the srq on top of the con_req_num posted at listen
+// time. a retiring chunk keeps its buffers as they come back instead of
+// reposting them, and is freed once requests have consumed all of them.
+struct srq_chunk {
+  struct rdma_device *dev;
+  struct mr_bulk *mrs;
+  struct server_req_ctx *requests;
+  uint32_t num;
+  uint32_t returned; // updated atomically by the cq pollers
+  bool retiring;
+  TAILQ_ENTRY(srq_chunk) next;
 };
 struct fini_ctx_t {
   uint32_t thread_id;
@@ -69,28 +329,96 @@ struct fini_ctx_t {
   kv_app_func cb;
   void *cb_arg;
 };
-struct kv_rdma {
+// every device opened by the cm has its own pd, and once it gets a connection,
+// its own cq pollers and, for a server, its own srq.
+struct rdma_device {
+  struct kv_rdma *self;
+  uint32_t index;
   struct ibv_context *ctx;
   struct ibv_pd *pd;
-  struct ibv_cq *cq;
+  struct ibv_device_attr dev_attr;
+  struct cq_poller_ctx *cq_pollers;
+  // server data
+  struct ibv_srq *srq;
+  struct mr_bulk *mrs;
+  struct server_req_ctx *requests;
+  // the srq raises IBV_EVENT_SRQ_LIMIT_REACHED once fewer than srq_limit
+  // receives are left, the cm poller then adds a chunk of con_req_num buffers
+  // up to srq_max_num. the newest chunk is retired after srq_shrink_ms
+  // without such an event.
+  uint32_t srq_num, srq_max_num, srq_limit;
+  bool srq_armed;
+  uint64_t srq_event_ms;
+  uint64_t srq_limit_events;
+  TAILQ_HEAD(srq_chunk_list, srq_chunk) srq_chunks;
+  struct srq_chunk *srq_retiring;
+  // ud server data
+  uint8_t ud_port;
+  uint32_t ud_msg_sz; // largest datagram, 0 until the ud endpoints exist
+};
+struct kv_rdma {
+  struct ibv_context **dev_list;
+  struct rdma_device *devs;
+  uint32_t dev_num;
   struct rdma_event_channel *ec;
   void *cm_poller;
-  bool has_server;
+  bool has_server, server_ready;
   uint32_t thread_num;
   uint32_t thread_id;
-  struct cq_poller_ctx *cq_pollers;
+  uint32_t next_thread; // qps are assigned to cq pollers round-robin
+  uint32_t signal_interval;
+  uint32_t inline_threshold;
+  uint32_t max_inline_data; // granted by the device for the last qp
+  uint32_t rndv_threshold;
+  struct rdma_stats stats[MAX_TASKS_NUM];
+  struct reg_cache reg_cache;
+  struct slab slabs[SLAB_NUM];
   // client data
+  uint32_t auto_resp_sz;
+  uint32_t req_timeout_ms;
   uint32_t conn_id;
+  // hybrid polling, see cq_poller_ctx.
+  uint32_t idle_spin_us, idle_period_us;
+  uint32_t resp_delay_us; // see resp_batch, 0 posts responses right away
   // server data
-  struct ibv_srq *srq;
   uint32_t con_req_num;
   uint32_t max_msg_sz;
-  pthread_rwlock_t lock;
-  struct mr_bulk *mrs;
-  struct server_req_ctx *requests;
-  struct rdma_connection *connections;
+  uint32_t credits; // granted to each client connection
+  uint32_t srq_max_num, srq_shrink_ms; // per device
+  // large buffers requests are pulled into by rendezvous, the ctxs waiting
+  // for a buffer are queued in rndv_pending.
+  uint32_t rndv_buf_sz, rndv_buf_num;
+  struct mr_bulk *rndv_mrs;
+  pthread_spinlock_t rndv_lock;
+  struct ibv_mr **rndv_free;
+  uint32_t rndv_free_num;
+  STAILQ_HEAD(, server_req_ctx) rndv_pending;
+  // server connections indexed by the slot carried in each request header.
+  // only the cm poller writes the table, cq pollers read it without locks.
+  struct rdma_connection **conns;
+  uint32_t conn_num, max_slot;
   kv_rdma_server_init_cb init_cb;
   void *init_cb_arg;
+  kv_rdma_req_handler msg_handler; // of the one-way messages
+  void *msg_arg;
+  // regions given to clients on connect. they are only ever appended, under
+  // the lock, and those below export_num are read without it.
+  pthread_spinlock_t export_lock;
+  struct {
+    char name[KV_RDMA_NAME_LEN];
+    struct ibv_mr *mr;
+  } exports[KV_RDMA_MAX_EXPORTS];
+  uint32_t export_num;
+  // where handlers run, see kv_rdma_dispatch. worker_load counts the
+  // requests of each pool thread not responded to yet.
+  enum kv_rdma_dispatch_mode dispatch;
+  uint32_t first_worker, worker_num, next_worker;
+  uint32_t *worker_load;
+  // ud sessions indexed by the id carried in each datagram, written by the
+  // cm poller and by the cq poller of a closing session.
+  struct ud_session **ud_sessions;
+  uint32_t ud_recv_num;
+  uint32_t ud_rto_us, ud_retries;
   // finish ctx
   struct fini_ctx_t fini_ctx;
 };
@@ -99,55 +427,316 @@ struct client_req_ctx {
   kv_rdma_req_cb cb;
   void *cb_arg;
   struct ibv_mr *req, *resp;
+  bool auto_resp; // resp is taken from the slab and freed after cb
+  bool oneway;    // done with once sent, resp is NULL
+  uint16_t gen;   // kept across uses of the ctx
+  uint32_t timeout_ms;
+  struct kv_timer timer;
+  uint32_t sge_num, len; // of the prepared send
+  struct ibv_sge sges[KV_RDMA_MAX_SGE + 1];
+  uint8_t *resp_buf; // ud: where the response is copied, stream: the ring
+  STAILQ_ENTRY(client_req_ctx) next; // queued while out of credits
+  bool queued; // in pending, under the lock of the connection
+  struct rndv_desc desc;
+  // stream state, the ack fields are under the lock of the connection.
+  kv_rdma_chunk_cb chunk_cb; // NULL if not a stream
+  struct stream_desc sdesc;
+  uint32_t seq, acked, ack_sent;
+  bool ack_busy; // an ack is being sent
+  bool ended;    // the last chunk came while an ack was being sent
+  struct req_header ack;
+  LIST_ENTRY(client_req_ctx) stream_entry;
+  uint8_t inline_data[]; // payload of a queued inline request
+};
+// a one-sided operation in flight, taken from the pool of its connection.
+struct rw_ctx {
+  struct rdma_connection *conn;
+  kv_rdma_resp_cb cb;
+  void *cb_arg;
+};
+struct stream_chunk {
+  struct ibv_sge sge;
+  bool last;
+  bool dropped; // larger than a slot, sent empty to end the stream
+  kv_rdma_resp_cb cb;
+  void *cb_arg;
+  STAILQ_ENTRY(stream_chunk) next;
 };
+STAILQ_HEAD(stream_chunk_list, stream_chunk);
 struct server_req_ctx {
   struct rdma_connection *conn;
   struct kv_rdma *self;
+  struct rdma_device *dev; // of the srq the receive buffer belongs to
   uint32_t resp_rkey;
-  struct ibv_mr *mr;
+  struct ibv_mr *mr;     // the receive buffer
+  struct ibv_mr *req_mr; // the buffer handed to the handler
+  struct srq_chunk *chunk; // NULL for the buffers posted at listen time
   struct req_header header;
+  kv_rdma_resp_cb resp_cb;
+  void *resp_cb_arg;
+  // rendezvous state
+  uint32_t rndv_len, rndv_reads;
+  bool rndv_failed;
+  STAILQ_ENTRY(server_req_ctx) next;
+  // a datagram of a ud session, whose slot holds the response.
+  struct ud_session *ud;
+  uint32_t ud_slot;
+  // the handler call, kept while it is dispatched to a worker.
+  kv_rdma_req_handler handler;
+  void *handler_arg;
+  uint32_t req_sz;
+  uint32_t worker; // in the pool, NO_WORKER if not dispatched to it
+  bool conn_ref;   // holds a reference on conn until it is reposted
+  // stream state, under the stream lock of the connection. a stream holds
+  // its receive buffer until its last chunk is posted.
+  struct {
+    uint32_t slot_sz, slot_num;
+    uint32_t sent, acked; // chunks
+    bool closing;         // the last chunk has been written
+    bool broken;          // a chunk failed to be posted, the next ones fail
+    struct stream_chunk_list queue; // waiting for a free slot
+    LIST_ENTRY(server_req_ctx) entry;
+  } stream;
 };
+#define NO_WORKER (UINT32_MAX)
 
 // --- alloc and free ---
+// register [buf, buf + len) on every device, returns NULL on failure.
+static struct ibv_mr **reg_all(struct kv_rdma *self, void *buf, size_t len,
+                               int access) {
+  if (self->dev_num == 0)
+    return NULL;
+  struct ibv_mr **regs = kv_calloc(self->dev_num + 1, sizeof(struct ibv_mr *));
+  for (uint32_t i = 0; i < self->dev_num; i++) {
+    if ((regs[i] = ibv_reg_mr(self->devs[i].pd, buf, len, access)) == NULL) {
+      while (i--)
+        ibv_dereg_mr(regs[i]);
+      kv_free(regs);
+      return NULL;
+    }
+  }
+  return regs;
+}
+
+static void dereg_all(struct ibv_mr **regs) {
+  for (struct ibv_mr **reg = regs; *reg; reg++)
+    ibv_dereg_mr(*reg);
+  kv_free(regs);
+}
+
+// the keys of a handle on a device.
+static inline uint32_t mr_lkey(struct ibv_mr *mr, struct rdma_device *dev) {
+  return dev->index ? ((struct rdma_mr *)mr)->regs[dev->index]->lkey
+                    : mr->lkey;
+}
+
+static inline uint32_t mr_rkey(struct ibv_mr *mr, struct rdma_device *dev) {
+  return dev->index ? ((struct rdma_mr *)mr)->regs[dev->index]->rkey
+                    : mr->rkey;
+}
+
+// a handle of the part [addr, addr + len) of a registration.
+static inline void mr_narrow(struct rdma_mr *mr, struct ibv_mr **regs,
+                             void *addr, size_t len) {
+  mr->mr = *regs[0];
+  mr->mr.addr = addr;
+  mr->mr.length = len;
+  mr->regs = regs;
+}
+
 struct mr_bulk {
-  struct ibv_mr *mr;
+  struct ibv_mr **regs;
   uint8_t *buf;
-  struct ibv_mr *mrs;
+  struct rdma_mr *mrs;
 };
 kv_rdma_mrs_handle kv_rdma_alloc_bulk(kv_rdma_handle h,
                                       enum kv_rdma_mr_type type, size_t size,
                                       size_t count) {
   struct kv_rdma *self = h;
+  int access = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE |
+               IBV_ACCESS_REMOTE_READ;
+  if (type == KV_RDMA_MR_ATOMIC) {
+    for (uint32_t i = 0; i < self->dev_num; i++)
+      if (self->devs[i].dev_attr.atomic_cap == IBV_ATOMIC_NONE) {
+        fprintf(stderr, "kv_rdma_alloc_bulk: %s has no atomics.\n",
+                ibv_get_device_name(self->devs[i].ctx->device));
+        return NULL;
+      }
+    access |= IBV_ACCESS_REMOTE_ATOMIC;
+  }
   struct mr_bulk *mr_h = kv_malloc(sizeof(struct mr_bulk));
-  if (type != KV_RDMA_MR_RESP)
-    size += HEADER_SIZE;
-  mr_h->buf = kv_dma_malloc(size * count);
-  mr_h->mr = ibv_reg_mr(self->pd, mr_h->buf, size * count,
-                        IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE);
-  mr_h->mrs = kv_calloc(count, sizeof(struct ibv_mr));
-  for (size_t i = 0; i < count; i++) {
-    mr_h->mrs[i] = *mr_h->mr;
-    mr_h->mrs[i].addr = (char *)mr_h->mr->addr + i * size;
-    mr_h->mrs[i].length = size;
+  if (type == KV_RDMA_MR_ATOMIC) {
+    // each buffer holds whole aligned words.
+    size = (size + 7) & ~(size_t)7;
+    mr_h->buf = kv_dma_zmalloc_align(size * count, 8);
+  } else {
+    if (type != KV_RDMA_MR_RESP)
+      size += HEADER_SIZE;
+    mr_h->buf = kv_dma_malloc(size * count);
   }
+  if ((mr_h->regs = reg_all(self, mr_h->buf, size * count, access)) == NULL) {
+    fprintf(stderr, "kv_rdma_alloc_bulk: fail to register %zu bytes.\n",
+            size * count);
+    kv_dma_free(mr_h->buf);
+    kv_free(mr_h);
+    return NULL;
+  }
+  mr_h->mrs = kv_calloc(count, sizeof(struct rdma_mr));
+  for (size_t i = 0; i < count; i++)
+    mr_narrow(mr_h->mrs + i, mr_h->regs, mr_h->buf + i * size, size);
   return mr_h;
 }
 kv_rdma_mr kv_rdma_mrs_get(kv_rdma_mrs_handle h, size_t index) {
-  return ((struct mr_bulk *)h)->mrs + index;
+  return &((struct mr_bulk *)h)->mrs[index].mr;
 }
 void kv_rdma_free_bulk(kv_rdma_mrs_handle h) {
   struct mr_bulk *mr_h = h;
-  ibv_dereg_mr(mr_h->mr);
+  dereg_all(mr_h->regs);
   kv_dma_free(mr_h->buf);
   kv_free(mr_h->mrs);
   kv_free(mr_h);
 }
 
-kv_rdma_mr kv_rdma_alloc_req(kv_rdma_handle h, uint32_t size) {
-  struct kv_rdma *self = h;
-  size += HEADER_SIZE;
+static void slab_init(struct kv_rdma *self, struct slab *slab, size_t size,
+                      int access) {
+  slab->self = self;
+  slab->access = access;
+  pthread_spin_init(&slab->lock, PTHREAD_PROCESS_PRIVATE);
+  slab->chunk_num = size >> SLAB_CHUNK_SHIFT;
+  slab->size = (size_t)slab->chunk_num << SLAB_CHUNK_SHIFT;
+  if (slab->chunk_num)
+    slab->chunks = kv_calloc(slab->chunk_num, sizeof(struct slab_buf *));
+}
+
+static void slab_fini(struct slab *slab) {
+  if (slab->regs) {
+    dereg_all(slab->regs);
+    kv_dma_free(slab->buf);
+  }
+  for (uint32_t i = 0; i < slab->chunk_used; i++)
+    kv_free(slab->chunks[i]);
+  kv_free(slab->chunks);
+  pthread_spin_destroy(&slab->lock);
+}
+
+static inline uint32_t slab_class(size_t size) {
+  if (size <= (1UL << SLAB_MIN_SHIFT))
+    return 0;
+  return 64 - __builtin_clzl(size - 1) - SLAB_MIN_SHIFT;
+}
+
+// move a batch of free buffers of cls into list, carving a new chunk if the
+// shared list is empty. called with the lock held.
+static void slab_refill(struct slab *slab, uint32_t cls,
+                        struct slab_list *list) {
+  struct slab_list *shared = slab->shared + cls;
+  if (shared->num) {
+    while (shared->num && list->num < SLAB_BATCH) {
+      struct slab_buf *b = shared->head;
+      shared->head = b->next;
+      shared->num--;
+      b->next = list->head;
+      list->head = b;
+      list->num++;
+    }
+    return;
+  }
+  if (slab->chunk_used == slab->chunk_num)
+    return;
+  if (slab->regs == NULL) {
+    slab->buf = kv_dma_malloc(slab->size);
+    slab->regs = reg_all(slab->self, slab->buf, slab->size, slab->access);
+    if (slab->regs == NULL) {
+      fprintf(stderr, "slab_refill: fail to register the slab.\n");
+      kv_dma_free(slab->buf);
+      slab->chunk_num = 0;
+      return;
+    }
+  }
+  size_t buf_sz = 1UL << (cls + SLAB_MIN_SHIFT);
+  uint32_t n = 1U << (SLAB_CHUNK_SHIFT - SLAB_MIN_SHIFT - cls);
+  uint8_t *chunk = slab->buf + ((size_t)slab->chunk_used << SLAB_CHUNK_SHIFT);
+  struct slab_buf *bufs = kv_calloc(n, sizeof(struct slab_buf));
+  slab->chunks[slab->chunk_used++] = bufs;
+  for (uint32_t i = 0; i < n; i++) {
+    mr_narrow(&bufs[i].mr, slab->regs, chunk + i * buf_sz, buf_sz);
+    bufs[i].mr.kind = MR_SLAB;
+    bufs[i].slab = slab;
+    bufs[i].cls = cls;
+    bufs[i].next = list->head;
+    list->head = bufs + i;
+  }
+  list->num += n;
+}
+
+static struct ibv_mr *slab_alloc(struct kv_rdma *self, size_t size,
+                                 int access) {
+  struct slab *slab = self->slabs + (access & IBV_ACCESS_REMOTE_WRITE
+                                         ? SLAB_RESP
+                                         : SLAB_REQ);
+  uint32_t cls = slab_class(size);
+  struct slab_buf *b = NULL;
+  if (cls < SLAB_CLASS_NUM) {
+    struct slab_list *list = slab->local[kv_app_get_thread_index()].l + cls;
+    if (list->head == NULL) {
+      pthread_spin_lock(&slab->lock);
+      slab_refill(slab, cls, list);
+      pthread_spin_unlock(&slab->lock);
+    }
+    if ((b = list->head)) {
+      list->head = b->next;
+      list->num--;
+      return &b->mr.mr;
+    }
+  }
+  // too large for the slab or out of slab memory, register it on its own.
+  b = kv_calloc(1, sizeof(struct slab_buf));
   uint8_t *buf = kv_dma_malloc(size);
-  return ibv_reg_mr(self->pd, buf, size, 0);
+  struct ibv_mr **regs = reg_all(self, buf, size, access);
+  if (regs == NULL) {
+    fprintf(stderr, "slab_alloc: fail to register %zu bytes.\n", size);
+    kv_dma_free(buf);
+    kv_free(b);
+    return NULL;
+  }
+  mr_narrow(&b->mr, regs, buf, size);
+  b->mr.kind = MR_SLAB;
+  b->slab = slab;
+  b->cls = SLAB_LARGE;
+  return &b->mr.mr;
+}
+
+static void slab_free(struct slab_buf *b) {
+  if (b->cls == SLAB_LARGE) {
+    uint8_t *buf = b->mr.mr.addr;
+    dereg_all(b->mr.regs);
+    kv_dma_free(buf);
+    kv_free(b);
+    return;
+  }
+  struct slab *slab = b->slab;
+  struct slab_list *list = slab->local[kv_app_get_thread_index()].l + b->cls;
+  b->next = list->head;
+  list->head = b;
+  // give back a batch, buffers freed by other threads would pile up here.
+  if (++list->num < 2 * SLAB_BATCH)
+    return;
+  struct slab_list *shared = slab->shared + b->cls;
+  pthread_spin_lock(&slab->lock);
+  for (uint32_t i = 0; i < SLAB_BATCH; i++) {
+    b = list->head;
+    list->head = b->next;
+    b->next = shared->head;
+    shared->head = b;
+  }
+  list->num -= SLAB_BATCH;
+  shared->num += SLAB_BATCH;
+  pthread_spin_unlock(&slab->lock);
+}
+
+kv_rdma_mr kv_rdma_alloc_req(kv_rdma_handle h, uint32_t size) {
+  // the server pulls large requests with RDMA READ.
+  return slab_alloc(h, size + HEADER_SIZE, IBV_ACCESS_REMOTE_READ);
 }
 
 uint8_t *kv_rdma_get_req_buf(kv_rdma_mr mr) {
@@ -155,9 +744,7 @@ uint8_t *kv_rdma_get_req_buf(kv_rdma_mr mr) {
 }
 
 kv_rdma_mr kv_rdma_alloc_resp(kv_rdma_handle h, uint32_t size) {
-  struct kv_rdma *self = h;
-  uint8_t *buf = kv_dma_malloc(size);
-  return ibv_reg_mr(self->pd, buf, size,
+  return slab_alloc(h, size,
                     IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE);
 }
 
@@ -166,80 +753,655 @@ uint8_t *kv_rdma_get_resp_buf(kv_rdma_mr mr) {
 }
 
 void kv_rdma_free_mr(kv_rdma_mr h) {
-  struct ibv_mr *mr = h;
-  uint8_t *buf = mr->addr;
-  ibv_dereg_mr(mr);
-  kv_dma_free(buf);
+  struct slab_buf *b = h;
+  if (b->mr.kind != MR_SLAB) {
+    fprintf(stderr, "kv_rdma_free_mr: %p is not from kv_rdma_alloc_req/"
+                    "alloc_resp.\n", h);
+    return;
+  }
+  slab_free(b);
+}
+
+// --- registration cache ---
+static inline void reg_update(struct reg_entry *e) {
+  e->max_end = e->end;
+  if (e->left && e->left->max_end > e->max_end)
+    e->max_end = e->left->max_end;
+  if (e->right && e->right->max_end > e->max_end)
+    e->max_end = e->right->max_end;
+}
+
+// entries are ordered by (start, address of the entry).
+static inline bool reg_before(struct reg_entry *a, struct reg_entry *b) {
+  return a->start < b->start || (a->start == b->start && a < b);
+}
+
+static void reg_split(struct reg_entry *t, struct reg_entry *key,
+                      struct reg_entry **l, struct reg_entry **r) {
+  if (t == NULL) {
+    *l = *r = NULL;
+  } else if (reg_before(t, key)) {
+    reg_split(t->right, key, &t->right, r);
+    *l = t;
+    reg_update(t);
+  } else {
+    reg_split(t->left, key, l, &t->left);
+    *r = t;
+    reg_update(t);
+  }
+}
+
+static struct reg_entry *reg_merge(struct reg_entry *l, struct reg_entry *r) {
+  if (l == NULL || r == NULL)
+    return l ? l : r;
+  if (l->prio > r->prio) {
+    l->right = reg_merge(l->right, r);
+    reg_update(l);
+    return l;
+  }
+  r->left = reg_merge(l, r->left);
+  reg_update(r);
+  return r;
+}
+
+static struct reg_entry *reg_insert(struct reg_entry *t, struct reg_entry *e) {
+  if (t == NULL || e->prio > t->prio) {
+    reg_split(t, e, &e->left, &e->right);
+    reg_update(e);
+    return e;
+  }
+  if (reg_before(e, t))
+    t->left = reg_insert(t->left, e);
+  else
+    t->right = reg_insert(t->right, e);
+  reg_update(t);
+  return t;
+}
+
+static struct reg_entry *reg_erase(struct reg_entry *t, struct reg_entry *e) {
+  if (t == e)
+    return reg_merge(t->left, t->right);
+  if (reg_before(e, t))
+    t->left = reg_erase(t->left, e);
+  else
+    t->right = reg_erase(t->right, e);
+  reg_update(t);
+  return t;
+}
+
+// find an entry covering [start, end).
+static struct reg_entry *reg_find(struct reg_entry *t, uintptr_t start,
+                                  uintptr_t end) {
+  while (t && t->max_end >= end) {
+    if (t->left && t->left->max_end >= end) {
+      struct reg_entry *e = reg_find(t->left, start, end);
+      if (e)
+        return e;
+    }
+    if (t->start > start)
+      return NULL;
+    if (t->end >= end)
+      return t;
+    t = t->right;
+  }
+  return NULL;
+}
+
+// push the entries overlapping [start, end) onto list.
+static void reg_overlap(struct reg_entry *t, uintptr_t start, uintptr_t end,
+                        struct reg_entry **list) {
+  if (t == NULL || t->max_end <= start)
+    return;
+  reg_overlap(t->left, start, end, list);
+  if (t->start >= end)
+    return;
+  reg_overlap(t->right, start, end, list);
+  if (t->end > start) {
+    t->next = *list;
+    *list = t;
+  }
+}
+
+// drop the lru head, returned for deregistration outside the lock.
+static struct reg_entry *reg_evict(struct reg_cache *cache) {
+  struct reg_entry *e = TAILQ_FIRST(&cache->lru);
+  TAILQ_REMOVE(&cache->lru, e, lru);
+  cache->idle_num--;
+  cache->evictions++;
+  cache->root = reg_erase(cache->root, e);
+  return e;
+}
+
+static void reg_destroy(struct reg_entry *e) {
+  dereg_all(e->mr.regs);
+  kv_free(e);
+}
+
+kv_rdma_mr kv_rdma_reg_mem(kv_rdma_handle h, void *addr, size_t len) {
+  struct kv_rdma *self = h;
+  struct reg_cache *cache = &self->reg_cache;
+  uintptr_t start = (uintptr_t)addr, end = start + len;
+  struct reg_entry *e;
+  pthread_mutex_lock(&cache->lock);
+  if ((e = reg_find(cache->root, start, end))) {
+    if (e->ref++ == 0) {
+      TAILQ_REMOVE(&cache->lru, e, lru);
+      cache->idle_num--;
+    }
+    cache->hits++;
+    pthread_mutex_unlock(&cache->lock);
+    return &e->mr.mr;
+  }
+  cache->misses++;
+  pthread_mutex_unlock(&cache->lock);
+  // register whole pages, neighbouring buffers then share the registration.
+  uintptr_t page_sz = (uintptr_t)sysconf(_SC_PAGESIZE);
+  start &= ~(page_sz - 1);
+  end = (end + page_sz - 1) & ~(page_sz - 1);
+  struct ibv_mr **regs =
+      reg_all(self, (void *)start, end - start,
+              IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE |
+                  IBV_ACCESS_REMOTE_READ);
+  if (regs == NULL) {
+    fprintf(stderr, "kv_rdma_reg_mem: fail to register %p.\n", addr);
+    return NULL;
+  }
+  e = kv_malloc(sizeof(struct reg_entry));
+  e->mr.mr = *regs[0];
+  e->mr.regs = regs;
+  e->mr.kind = MR_REG;
+  e->start = start;
+  e->end = end;
+  e->ref = 1;
+  e->cached = true;
+  e->left = e->right = NULL;
+  pthread_mutex_lock(&cache->lock);
+  cache->seed = cache->seed * 1103515245 + 12345;
+  e->prio = cache->seed;
+  cache->root = reg_insert(cache->root, e);
+  pthread_mutex_unlock(&cache->lock);
+  return &e->mr.mr;
+}
+
+void kv_rdma_dereg_mem(kv_rdma_handle h, kv_rdma_mr mr) {
+  struct kv_rdma *self = h;
+  struct reg_cache *cache = &self->reg_cache;
+  struct reg_entry *e = mr, *evicted = NULL;
+  if (e->mr.kind != MR_REG) {
+    fprintf(stderr, "kv_rdma_dereg_mem: %p is not from kv_rdma_reg_mem.\n",
+            mr);
+    return;
+  }
+  pthread_mutex_lock(&cache->lock);
+  assert(e->ref);
+  if (--e->ref == 0) {
+    if (e->cached) {
+      TAILQ_INSERT_TAIL(&cache->lru, e, lru);
+      if (++cache->idle_num > cache->max_idle)
+        evicted = reg_evict(cache);
+    } else {
+      evicted = e;
+    }
+  }
+  pthread_mutex_unlock(&cache->lock);
+  if (evicted)
+    reg_destroy(evicted);
+}
+
+void kv_rdma_reg_invalidate(kv_rdma_handle h, void *addr, size_t len) {
+  struct kv_rdma *self = h;
+  struct reg_cache *cache = &self->reg_cache;
+  struct reg_entry *list = NULL, *e, *freed = NULL;
+  pthread_mutex_lock(&cache->lock);
+  reg_overlap(cache->root, (uintptr_t)addr, (uintptr_t)addr + len, &list);
+  while ((e = list)) {
+    list = e->next;
+    cache->root = reg_erase(cache->root, e);
+    e->cached = false;
+    if (e->ref == 0) {
+      TAILQ_REMOVE(&cache->lru, e, lru);
+      cache->idle_num--;
+      e->next = freed;
+      freed = e;
+    }
+  }
+  pthread_mutex_unlock(&cache->lock);
+  while ((e = freed)) {
+    freed = e->next;
+    reg_destroy(e);
+  }
+}
+
+static void reg_cache_fini(struct reg_cache *cache) {
+  while (!TAILQ_EMPTY(&cache->lru))
+    reg_destroy(reg_evict(cache));
+  pthread_mutex_destroy(&cache->lock);
+}
+
+// --- send queue ---
+static void sq_init(struct send_queue *sq) {
+  pthread_spin_init(&sq->lock, PTHREAD_PROCESS_PRIVATE);
+  sq->head = sq->signal_seq = sq->idle_mark = sq->completed = 0;
+  sq->entries = kv_calloc(MAX_Q_NUM, sizeof(struct sq_entry));
+}
+
+static void sq_fini(struct send_queue *sq) {
+  if (sq->entries == NULL)
+    return;
+  pthread_spin_destroy(&sq->lock);
+  kv_free(sq->entries);
+  sq->entries = NULL;
+}
+
+// post a chain of WRs, wrs must be an array linked in order and the wr_id of
+// each WR is the ctx passed to done once the WR is reclaimed. a WR is signaled
+// if it requests IBV_SEND_SIGNALED or if signal_interval WRs are uncovered.
+// returns the number of posted WRs, which is less than n if the send queue is
+// full or ibv_post_send fails.
+static uint32_t sq_post(struct rdma_connection *conn, struct ibv_send_wr *wrs,
+                        uint32_t n, sq_done_cb done) {
+  struct send_queue *sq = &conn->sq;
+  struct ibv_send_wr *bad_wr = NULL;
+  uint32_t interval = conn->self->signal_interval;
+  pthread_spin_lock(&sq->lock);
+  uint32_t used =
+      sq->head - __atomic_load_n(&sq->completed, __ATOMIC_ACQUIRE);
+  if (n > MAX_Q_NUM - used)
+    n = MAX_Q_NUM - used;
+  if (n == 0) {
+    pthread_spin_unlock(&sq->lock);
+    return 0;
+  }
+  uint32_t signal_seq = sq->signal_seq;
+  for (uint32_t i = 0; i < n; i++) {
+    uint32_t seq = sq->head + i;
+    struct sq_entry *e = sq->entries + (seq & (MAX_Q_NUM - 1));
+    *e = (struct sq_entry){conn, seq, seq, done, (void *)wrs[i].wr_id};
+    if ((wrs[i].send_flags & IBV_SEND_SIGNALED) ||
+        seq + 1 - signal_seq >= interval) {
+      wrs[i].send_flags |= IBV_SEND_SIGNALED;
+      e->first = signal_seq;
+      signal_seq = seq + 1;
+    }
+    wrs[i].wr_id = (uintptr_t)e | WR_SEND;
+  }
+  wrs[n - 1].next = NULL;
+  if (ibv_post_send(conn->qp, wrs, &bad_wr)) {
+    n = bad_wr - wrs;
+    signal_seq = sq->signal_seq;
+    for (uint32_t i = 0; i < n; i++)
+      if (wrs[i].send_flags & IBV_SEND_SIGNALED)
+        signal_seq = sq->head + i + 1;
+  }
+  sq->head += n;
+  sq->signal_seq = signal_seq;
+  pthread_spin_unlock(&sq->lock);
+  return n;
+}
+
+// take the entries reclaimed by a completion out of the send queue. an error
+// completion may also be reported for an unsignaled WR, entries already taken
+// are skipped.
+static uint32_t sq_take(struct send_queue *sq, struct sq_entry *e,
+                        struct sq_entry *out) {
+  uint32_t cnt = 0;
+  pthread_spin_lock(&sq->lock);
+  for (uint32_t seq = e->first; seq != e->seq + 1; seq++) {
+    struct sq_entry *it = sq->entries + (seq & (MAX_Q_NUM - 1));
+    if (it->done == NULL)
+      continue;
+    out[cnt++] = *it;
+    it->done = NULL;
+  }
+  pthread_spin_unlock(&sq->lock);
+  return cnt;
+}
+
+static void on_send_done(struct ibv_wc *wc) {
+  struct sq_entry *e = (struct sq_entry *)(wc->wr_id & ~(uint64_t)WR_KIND),
+                  out[MAX_SIGNAL_INTERVAL];
+  struct send_queue *sq = &e->conn->sq;
+  uint32_t last = e->seq, cnt = sq_take(sq, e, out);
+  for (uint32_t i = 0; i < cnt; i++)
+    out[i].done(out[i].ctx,
+                out[i].seq != last || wc->status == IBV_WC_SUCCESS);
+  __atomic_fetch_add(&sq->completed, cnt, __ATOMIC_RELEASE);
+}
+
+static void on_flush_done(__attribute__((unused)) void *ctx, bool success) {
+  if (!success)
+    fprintf(stderr, "on_flush_done: flush failed.\n");
+}
+
+// the entries behind the last signaled WR are only reclaimed by a later
+// signaled WR. if a connection stays idle, post a zero-length signaled
+// RDMA_WRITE to reclaim them.
+static void sq_flush_idle(struct rdma_connection *conn) {
+  struct send_queue *sq = &conn->sq;
+  pthread_spin_lock(&sq->lock);
+  bool idle = sq->head == sq->idle_mark && sq->signal_seq != sq->head;
+  sq->idle_mark = sq->head;
+  pthread_spin_unlock(&sq->lock);
+  if (idle) {
+    struct ibv_send_wr wr;
+    memset(&wr, 0, sizeof(wr));
+    wr.opcode = IBV_WR_RDMA_WRITE;
+    wr.send_flags = IBV_SEND_SIGNALED;
+    sq_post(conn, &wr, 1, on_flush_done);
+  }
+}
+
+// reclaim the entries left behind a destroyed qp.
+static void sq_drain(struct send_queue *sq) {
+  for (uint32_t seq = sq->head - MAX_Q_NUM; seq != sq->head; seq++) {
+    struct sq_entry *it = sq->entries + (seq & (MAX_Q_NUM - 1)), e;
+    pthread_spin_lock(&sq->lock);
+    e = *it;
+    it->done = NULL;
+    pthread_spin_unlock(&sq->lock);
+    if (e.done)
+      e.done(e.ctx, false);
+  }
 }
 
 // --- cm_poller ---
+static inline uint64_t now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static inline uint64_t now_ms(void) { return now_us() / 1000; }
+
+static void srq_post_bufs(struct rdma_device *dev,
+                          struct server_req_ctx *requests, struct mr_bulk *mrs,
+                          uint32_t num, struct srq_chunk *chunk) {
+  struct kv_rdma *self = dev->self;
+  struct ibv_recv_wr wr, *bad_wr = NULL;
+  struct ibv_sge sge = {0, self->max_msg_sz + HEADER_SIZE,
+                        mrs->regs[dev->index]->lkey};
+  wr.next = NULL;
+  wr.sg_list = &sge;
+  wr.num_sge = 1;
+  for (size_t i = 0; i < num; i++) {
+    requests[i].self = self;
+    requests[i].dev = dev;
+    requests[i].mr = kv_rdma_mrs_get(mrs, i);
+    requests[i].req_mr = requests[i].mr;
+    requests[i].chunk = chunk;
+    requests[i].conn_ref = false;
+    sge.addr = (uint64_t)requests[i].mr->addr;
+    wr.wr_id = (uint64_t)(requests + i);
+    TEST_NZ(ibv_post_srq_recv(dev->srq, &wr, &bad_wr));
+  }
+}
+
+// the limit disarms itself once reached, it is rearmed after each growth.
+static void srq_arm(struct rdma_device *dev) {
+  struct ibv_srq_attr attr = {.srq_limit = dev->srq_limit};
+  if (dev->srq_limit == 0 || dev->srq_num >= dev->srq_max_num)
+    return;
+  if (ibv_modify_srq(dev->srq, &attr, IBV_SRQ_LIMIT)) {
+    fprintf(stderr, "kv_rdma: fail to arm the srq limit.\n");
+    dev->srq_limit = 0;
+    return;
+  }
+  dev->srq_armed = true;
+}
+
+static void srq_grow(struct rdma_device *dev) {
+  struct kv_rdma *self = dev->self;
+  uint32_t num = self->con_req_num;
+  if (num > dev->srq_max_num - dev->srq_num)
+    num = dev->srq_max_num - dev->srq_num;
+  if (num == 0)
+    return;
+  // the srq just keeps running low if the buffers cannot be registered.
+  struct mr_bulk *mrs =
+      kv_rdma_alloc_bulk(self, KV_RDMA_MR_SERVER, self->max_msg_sz, num);
+  if (mrs == NULL)
+    return;
+  struct srq_chunk *chunk = kv_calloc(1, sizeof(struct srq_chunk));
+  chunk->dev = dev;
+  chunk->num = num;
+  chunk->requests = kv_calloc(num, sizeof(struct server_req_ctx));
+  chunk->mrs = mrs;
+  srq_post_bufs(dev, chunk->requests, chunk->mrs, num, chunk);
+  TAILQ_INSERT_TAIL(&dev->srq_chunks, chunk, next);
+  dev->srq_num += num;
+}
+
+static void srq_chunk_free(struct srq_chunk *chunk) {
+  kv_rdma_free_bulk(chunk->mrs);
+  kv_free(chunk->requests);
+  kv_free(chunk);
+}
+
+// retire the newest chunk once the srq stayed above its limit for
+// srq_shrink_ms, and free the retired chunk whose buffers are all back. the
+// posted receives of a chunk cannot be taken back from the srq, they only
+// come back as requests consume them. so the retired chunk of an idle server
+// stays allocated, and the next chunk is retired only after it is freed.
+static void srq_shrink(struct rdma_device *dev) {
+  struct srq_chunk *chunk = dev->srq_retiring;
+  if (chunk) {
+    if (__atomic_load_n(&chunk->returned, __ATOMIC_ACQUIRE) < chunk->num)
+      return;
+    TAILQ_REMOVE(&dev->srq_chunks, chunk, next);
+    dev->srq_num -= chunk->num;
+    dev->srq_retiring = NULL;
+    srq_chunk_free(chunk);
+    if (!dev->srq_armed)
+      srq_arm(dev);
+    return;
+  }
+  chunk = TAILQ_LAST(&dev->srq_chunks, srq_chunk_list);
+  if (chunk == NULL ||
+      now_ms() - dev->srq_event_ms < dev->self->srq_shrink_ms)
+    return;
+  __atomic_store_n(&chunk->retiring, true, __ATOMIC_RELEASE);
+  dev->srq_retiring = chunk;
+  dev->srq_event_ms = now_ms();
+}
+
+static void on_async_event(struct rdma_device *dev) {
+  struct ibv_async_event event;
+  while (ibv_get_async_event(dev->ctx, &event) == 0) {
+    switch (event.event_type) {
+    case IBV_EVENT_SRQ_LIMIT_REACHED:
+      dev->srq_armed = false;
+      dev->srq_limit_events++;
+      dev->srq_event_ms = now_ms();
+      srq_grow(dev);
+      srq_arm(dev);
+      break;
+    case IBV_EVENT_QP_LAST_WQE_REACHED:
+      break;
+    default:
+      fprintf(stderr, "kv_rdma: async event %s on %s.\n",
+              ibv_event_type_str(event.event_type),
+              ibv_get_device_name(dev->ctx->device));
+      break;
+    }
+    ibv_ack_async_event(&event);
+  }
+}
+
 static int rdma_cq_poller(void *arg);
-static void server_data_init(struct kv_rdma *self) {
+static void server_data_init(struct rdma_device *dev) {
+  struct kv_rdma *self = dev->self;
   struct ibv_srq_init_attr srq_init_attr;
   memset(&srq_init_attr, 0, sizeof(srq_init_attr));
   srq_init_attr.attr.max_wr = MAX_Q_NUM;
   srq_init_attr.attr.max_sge = 1;
-  TEST_Z(self->srq = ibv_create_srq(self->pd, &srq_init_attr));
+  TEST_Z(dev->srq = ibv_create_srq(dev->pd, &srq_init_attr));
 
-  self->requests = kv_calloc(self->con_req_num, sizeof(struct server_req_ctx));
-  self->mrs = kv_rdma_alloc_bulk(self, KV_RDMA_MR_SERVER, self->max_msg_sz,
-                                 self->con_req_num);
-  struct ibv_recv_wr wr, *bad_wr = NULL;
-  struct ibv_sge sge = {0, self->mrs->mr->length, self->mrs->mr->lkey};
-  wr.next = NULL;
-  wr.sg_list = &sge;
-  wr.num_sge = 1;
-  for (size_t i = 0; i < self->con_req_num; i++) {
-    self->requests[i].self = self;
-    self->requests[i].mr = kv_rdma_mrs_get(self->mrs, i);
-    sge.addr = (uint64_t)self->requests[i].mr->addr;
-    wr.wr_id = (uint64_t)(self->requests + i);
-    TEST_NZ(ibv_post_srq_recv(self->srq, &wr, &bad_wr));
+  dev->requests = kv_calloc(self->con_req_num, sizeof(struct server_req_ctx));
+  TEST_Z(dev->mrs = kv_rdma_alloc_bulk(self, KV_RDMA_MR_SERVER,
+                                       self->max_msg_sz, self->con_req_num));
+  srq_post_bufs(dev, dev->requests, dev->mrs, self->con_req_num, NULL);
+  dev->srq_num = self->con_req_num;
+  dev->srq_max_num = self->srq_max_num;
+  if (dev->srq_max_num > (uint32_t)dev->dev_attr.max_srq_wr)
+    dev->srq_max_num = dev->dev_attr.max_srq_wr;
+  if (dev->srq_max_num > MAX_Q_NUM)
+    dev->srq_max_num = MAX_Q_NUM;
+  dev->srq_limit = self->con_req_num / 4;
+  dev->srq_event_ms = now_ms();
+  TAILQ_INIT(&dev->srq_chunks);
+  srq_arm(dev);
+  // the rendezvous buffers are shared by the devices.
+  if (self->server_ready)
+    return;
+  self->server_ready = true;
+  pthread_spin_init(&self->rndv_lock, PTHREAD_PROCESS_PRIVATE);
+  STAILQ_INIT(&self->rndv_pending);
+  if (self->rndv_buf_num && self->rndv_buf_sz) {
+    TEST_Z(self->rndv_mrs =
+               kv_rdma_alloc_bulk(self, KV_RDMA_MR_SERVER, self->rndv_buf_sz,
+                                  self->rndv_buf_num));
+    self->rndv_free = kv_calloc(self->rndv_buf_num, sizeof(struct ibv_mr *));
+    for (size_t i = 0; i < self->rndv_buf_num; i++)
+      self->rndv_free[self->rndv_free_num++] =
+          kv_rdma_mrs_get(self->rndv_mrs, i);
   }
   if (self->init_cb)
     self->init_cb(self->init_cb_arg);
 }
 
+static void device_start(struct rdma_device *dev) {
+  struct kv_rdma *self = dev->self;
+  dev->cq_pollers = kv_calloc(self->thread_num, sizeof(struct cq_poller_ctx));
+  for (size_t i = 0; i < self->thread_num; i++) {
+    struct cq_poller_ctx *poller = dev->cq_pollers + i;
+    struct ibv_cq *cq;
+    struct ibv_comp_channel *channel = NULL;
+    if (self->idle_spin_us) {
+      TEST_Z(channel = ibv_create_comp_channel(dev->ctx));
+      int flag = fcntl(channel->fd, F_GETFL);
+      fcntl(channel->fd, F_SETFL, flag | O_NONBLOCK);
+    }
+    TEST_Z(cq = ibv_create_cq(dev->ctx, 3 * MAX_Q_NUM /* max_conn_num */, NULL,
+                              channel, 0));
+    *poller = (struct cq_poller_ctx){self, dev, cq, .poller = NULL};
+    poller->channel = channel;
+    pthread_spin_init(&poller->timer_lock, PTHREAD_PROCESS_PRIVATE);
+    kv_timer_wheel_init(&poller->wheel, now_ms());
+    kv_app_poller_register_on(self->thread_id + i, rdma_cq_poller, poller, 0,
+                              &poller->poller);
+  }
+}
+
+static struct rdma_device *device_of(struct kv_rdma *self,
+                                     struct ibv_context *ctx) {
+  for (uint32_t i = 0; i < self->dev_num; i++)
+    if (self->devs[i].ctx == ctx)
+      return self->devs + i;
+  return NULL;
+}
+
+// a client keeps RECV_RING_NUM zero-length receives posted for the responses,
+// the owning cq poller reposts them in chains of RECV_BATCH once consumed.
+// requests in flight are limited so that a response always finds one.
+#define RECV_BATCH (32U)
+#define RECV_RING_NUM (MAX_Q_NUM)
+// each update returns at least a quarter of the credits or IMM_MAX_CREDITS,
+// so fewer than this many are ever in flight.
+#define MAX_CREDIT_UPDATES (128U)
+// the chunks of a stream in flight are bounded by the slots of its ring.
+#define MAX_STREAM_SLOTS (512U)
+#define UD_RECV_NUM (64U) // receives of a ud client
+static void recv_post(struct rdma_connection *conn, uint32_t num) {
+  struct ibv_recv_wr wrs[RECV_BATCH], *bad_wr = NULL;
+  while (num) {
+    uint32_t n = num < RECV_BATCH ? num : RECV_BATCH;
+    for (uint32_t i = 0; i < n; i++)
+      wrs[i] = (struct ibv_recv_wr){(uintptr_t)conn | WR_RING, wrs + i + 1,
+                                    NULL, 0};
+    wrs[n - 1].next = NULL;
+    // the qp may be in error already while it is torn down.
+    if (ibv_post_recv(conn->qp, wrs, &bad_wr)) {
+      fprintf(stderr, "kv_rdma: fail to post receives.\n");
+      return;
+    }
+    num -= n;
+  }
+}
+
+static void ud_client_init(struct rdma_connection *conn);
+static int ud_accept(struct kv_rdma *self, struct rdma_cm_id *cm_id);
+static int ud_established(struct rdma_cm_id *cm_id,
+                          struct rdma_ud_param *param);
 static int create_connetion(struct kv_rdma *self, struct rdma_cm_id *cm_id) {
   struct rdma_connection *conn = cm_id->context;
   // --- build context ---
-  if (self->ctx == NULL) {
-    self->ctx = cm_id->verbs;
-    TEST_Z(self->pd = ibv_alloc_pd(self->ctx));
-    TEST_Z(self->cq = ibv_create_cq(self->ctx, 3 * MAX_Q_NUM /* max_conn_num */,
-                                    NULL, NULL, 0));
-    self->cq_pollers =
-        kv_calloc(self->thread_num, sizeof(struct cq_poller_ctx));
-    for (size_t i = 0; i < self->thread_num; i++) {
-      self->cq_pollers[i] =
-          (struct cq_poller_ctx){self, self->cq, .poller = NULL};
-      kv_app_poller_register_on(self->thread_id + i, rdma_cq_poller,
-                                self->cq_pollers + i, 0,
-                                &self->cq_pollers[i].poller);
-    }
-  }
-  // assume only have one context
-  assert(self->ctx == cm_id->verbs);
-  if (self->has_server && self->requests == NULL)
-    server_data_init(self);
+  struct rdma_device *dev = device_of(self, cm_id->verbs);
+  if (dev == NULL) {
+    fprintf(stderr, "kv_rdma: unknown device %s.\n",
+            ibv_get_device_name(cm_id->verbs->device));
+    return -1;
+  }
+  if (dev->cq_pollers == NULL)
+    device_start(dev);
+  if (self->has_server && dev->requests == NULL)
+    server_data_init(dev);
+  conn->dev = dev;
   // --- build qp ---
   struct ibv_qp_init_attr qp_attr;
   memset(&qp_attr, 0, sizeof(struct ibv_qp_init_attr));
-  qp_attr.send_cq = self->cq;
-  qp_attr.recv_cq = self->cq;
-  qp_attr.qp_type = IBV_QPT_RC;
+  conn->thread = self->next_thread++ % self->thread_num;
+  qp_attr.send_cq = dev->cq_pollers[conn->thread].cq;
+  qp_attr.recv_cq = dev->cq_pollers[conn->thread].cq;
+  bool ud = cm_id->ps == RDMA_PS_UDP;
+  qp_attr.qp_type = ud ? IBV_QPT_UD : IBV_QPT_RC;
   if (conn->is_server)
-    qp_attr.srq = self->srq;
+    qp_attr.srq = dev->srq;
 
   qp_attr.cap.max_send_wr = MAX_Q_NUM;
-  qp_attr.cap.max_recv_wr = MAX_Q_NUM;
-  qp_attr.cap.max_send_sge = 1;
+  qp_attr.cap.max_recv_wr = ud ? UD_RECV_NUM : MAX_Q_NUM;
+  // one more segment for the request header.
+  qp_attr.cap.max_send_sge = KV_RDMA_MAX_SGE + 1;
+  if ((int)qp_attr.cap.max_send_sge > dev->dev_attr.max_sge)
+    qp_attr.cap.max_send_sge = dev->dev_attr.max_sge;
   qp_attr.cap.max_recv_sge = 1;
-  TEST_NZ(rdma_create_qp(cm_id, self->pd, &qp_attr));
+  qp_attr.cap.max_inline_data = self->inline_threshold;
+  if (rdma_create_qp(cm_id, dev->pd, &qp_attr)) {
+    // the device may not support inline data of the requested size.
+    qp_attr.cap.max_inline_data = 0;
+    TEST_NZ(rdma_create_qp(cm_id, dev->pd, &qp_attr));
+  }
   conn->qp = cm_id->qp;
+  conn->qp_num = conn->qp->qp_num;
+  conn->max_sge = qp_attr.cap.max_send_sge;
+  if (!conn->is_server) {
+    TEST_Z(conn->u.c.mp_mr = ibv_reg_mr(
+               dev->pd, kv_mempool_get_ele(conn->u.c.mp, 0),
+               MAX_REQ_NUM * conn->u.c.ctx_sz, 0));
+  }
+  conn->max_inline = qp_attr.cap.max_inline_data < self->inline_threshold
+                         ? qp_attr.cap.max_inline_data
+                         : self->inline_threshold;
+  self->max_inline_data = qp_attr.cap.max_inline_data;
+  sq_init(&conn->sq);
+  if (!conn->is_server && ud)
+    ud_client_init(conn);
+  else if (!conn->is_server)
+    recv_post(conn, RECV_RING_NUM);
   return 0;
 }
 
+// both sides may issue RDMA READs (and atomics) to each other.
+static void rd_atomic_params(struct rdma_device *dev,
+                             struct rdma_conn_param *param) {
+  uint32_t depth = MAX_RD_ATOMIC;
+  if ((int)depth > dev->dev_attr.max_qp_rd_atom)
+    depth = dev->dev_attr.max_qp_rd_atom;
+  if ((int)depth > dev->dev_attr.max_qp_init_rd_atom)
+    depth = dev->dev_attr.max_qp_init_rd_atom;
+  param->responder_resources = depth;
+  param->initiator_depth = depth;
+}
+
 static inline int on_addr_resolved(struct kv_rdma *self,
                                    struct rdma_cm_id *cm_id) {
   TEST_NZ(create_connetion(self, cm_id));
@@ -250,26 +1412,48 @@ static inline int on_addr_resolved(struct kv_rdma *self,
 static inline int
 on_route_resolved(__attribute__((unused)) struct kv_rdma *self,
                   struct rdma_cm_id *cm_id) {
+  struct rdma_connection *conn = cm_id->context;
   struct rdma_conn_param cm_params;
   memset(&cm_params, 0, sizeof(cm_params));
+  rd_atomic_params(conn->dev, &cm_params);
   TEST_NZ(rdma_connect(cm_id, &cm_params));
   return 0;
 }
 
 static inline int on_connect_request(struct kv_rdma *self,
                                      struct rdma_cm_id *cm_id) {
-  struct rdma_connection *conn = kv_malloc(sizeof(struct rdma_connection)),
-                         *lconn = cm_id->context;
-  *conn = (struct rdma_connection){self, cm_id, NULL, true};
+  struct rdma_connection *conn, *lconn = cm_id->context;
+  uint32_t slot = 0;
+  while (slot < MAX_CONN_NUM && self->conns[slot])
+    slot++;
+  if (slot == MAX_CONN_NUM) {
+    fprintf(stderr, "kv_rdma: too many connections.\n");
+    rdma_reject(cm_id, NULL, 0);
+    return 0;
+  }
+  conn = kv_malloc(sizeof(struct rdma_connection));
+  *conn = (struct rdma_connection){self, cm_id, NULL, 0, true};
   conn->u.s.handler = lconn->u.s.handler;
   conn->u.s.arg = lconn->u.s.arg;
+  conn->u.s.slot = slot;
+  conn->u.s.refs = 1;
+  pthread_spin_init(&conn->u.s.stream_lock, PTHREAD_PROCESS_PRIVATE);
+  LIST_INIT(&conn->u.s.streams);
   cm_id->context = conn;
   TEST_NZ(create_connetion(self, cm_id));
-  pthread_rwlock_wrlock(&self->lock);
-  HASH_ADD(u.s.hh, self->connections, qp->qp_num, sizeof(uint32_t), conn);
-  pthread_rwlock_unlock(&self->lock);
+  // publish the connection only after it is fully built.
+  __atomic_store_n(self->conns + slot, conn, __ATOMIC_RELEASE);
+  self->conn_num++;
+  if (slot >= self->max_slot)
+    self->max_slot = slot + 1;
+  struct conn_private_data data = {
+      slot, self->max_msg_sz, self->rndv_mrs ? self->rndv_buf_sz : 0,
+      self->credits, __atomic_load_n(&self->export_num, __ATOMIC_ACQUIRE)};
   struct rdma_conn_param cm_params;
   memset(&cm_params, 0, sizeof(cm_params));
+  rd_atomic_params(conn->dev, &cm_params);
+  cm_params.private_data = &data;
+  cm_params.private_data_len = sizeof(data);
   TEST_NZ(rdma_accept(cm_id, &cm_params));
   return 0;
 }
@@ -279,15 +1463,48 @@ static inline int on_connect_error(__attribute__((unused)) struct kv_rdma *self,
   if (!conn->is_server) {
     if (conn->u.c.connect)
       conn->u.c.connect(NULL, conn->u.c.connect_arg);
+    sq_fini(&conn->sq);
+    kv_mempool_free(conn->u.c.rw_mp);
     kv_free(conn);
   }
   return 0;
 }
+// a connection whose peer sent no usable private data is handed out to no
+// one, it is torn down like any other.
+static void conn_refuse(struct rdma_connection *conn) {
+  fprintf(stderr, "kv_rdma: bad private data from the server.\n");
+  if (conn->u.c.connect)
+    conn->u.c.connect(NULL, conn->u.c.connect_arg);
+  conn->u.c.connect = NULL;
+  conn->u.c.disconnect = NULL;
+}
+static void dir_fetch(struct rdma_connection *conn);
+static void conn_ready(struct rdma_connection *conn);
 static inline int on_established(__attribute__((unused)) struct kv_rdma *self,
-                                 struct rdma_cm_id *cm_id) {
+                                 struct rdma_cm_id *cm_id,
+                                 struct rdma_conn_param *param) {
   struct rdma_connection *conn = cm_id->context;
-  if (!conn->is_server && conn->u.c.connect) {
-    conn->u.c.connect(conn, conn->u.c.connect_arg);
+  if (!conn->is_server) {
+    if (param->private_data_len < sizeof(struct conn_private_data)) {
+      conn_refuse(conn);
+      rdma_disconnect(cm_id);
+      return 0;
+    }
+    conn->u.c.peer = *(const struct conn_private_data *)param->private_data;
+    // a server without flow control grants no credits. up to RECV_BATCH - 1
+    // receives of the ring may be waiting to be reposted, and some are
+    // taken by credit updates and stream chunks.
+    uint32_t ring = RECV_RING_NUM - RECV_BATCH + 1 - MAX_CREDIT_UPDATES -
+                    MAX_STREAM_SLOTS;
+    conn->u.c.credits =
+        conn->u.c.peer.credits ? conn->u.c.peer.credits : MAX_REQ_NUM;
+    if (conn->u.c.credits > ring)
+      conn->u.c.credits = ring;
+    // the connection is handed out once it knows the server's regions.
+    if (conn->u.c.peer.export_num)
+      dir_fetch(conn);
+    else
+      conn_ready(conn);
   }
   if (conn->is_server) {
     struct sockaddr_in *addr = (struct sockaddr_in *)rdma_get_peer_addr(cm_id);
@@ -296,32 +1513,174 @@ static inline int on_established(__attribute__((unused)) struct kv_rdma *self,
   }
   return 0;
 }
-static inline int on_disconnect(struct rdma_cm_id *cm_id) {
-  struct rdma_connection *conn = cm_id->context;
-  if (conn->is_server) {
-    struct sockaddr_in *addr = (struct sockaddr_in *)rdma_get_peer_addr(cm_id);
-    printf("server: peer %s:%u disconnected.\n", inet_ntoa(addr->sin_addr),
-           ntohs(addr->sin_port));
-    pthread_rwlock_wrlock(&conn->self->lock);
-    HASH_DELETE(u.s.hh, conn->self->connections, conn);
-    pthread_rwlock_unlock(&conn->self->lock);
-  } else {
-    kv_mempool_free(conn->u.c.mp);
+
+static inline void req_put(struct rdma_connection *conn,
+                           struct client_req_ctx *ctx) {
+  ctx->gen++;
+  kv_mempool_put(conn->u.c.mp, ctx);
+  __atomic_sub_fetch(&conn->u.c.outstanding, 1, __ATOMIC_RELAXED);
+}
+
+static void stream_fail(struct rdma_connection *conn,
+                        struct client_req_ctx *ctx);
+static void req_fail(struct rdma_connection *conn,
+                     struct client_req_ctx *ctx) {
+  if (ctx->chunk_cb) {
+    stream_fail(conn, ctx);
+    return;
   }
-  rdma_destroy_qp(cm_id);
-  rdma_destroy_id(cm_id);
-  if (!conn->is_server && conn->u.c.disconnect)
-    conn->u.c.disconnect(conn->u.c.disconnect_arg);
-  kv_free(conn);
-  return 0;
+  if (ctx->cb)
+    ctx->cb(conn, false, ctx->req, ctx->resp, ctx->cb_arg);
+  if (ctx->auto_resp)
+    slab_free((struct slab_buf *)ctx->resp);
+  req_put(conn, ctx);
 }
 
-static int rdma_cm_poller(void *_self) {
+// a timed out request may still get a late response written into its
+// response buffer, an automatic one is therefore never reused. a request
+// still waiting for credits has taken none and is only dequeued, the credit
+// of a posted one comes back with its late response, if any.
+static void req_expire(struct rdma_connection *conn,
+                       struct client_req_ctx *ctx) {
+  pthread_spin_lock(&conn->u.c.lock);
+  if (ctx->queued) {
+    STAILQ_REMOVE(&conn->u.c.pending, ctx, client_req_ctx, next);
+    ctx->queued = false;
+  }
+  pthread_spin_unlock(&conn->u.c.lock);
+  STATS(conn->self)->timeouts++;
+  if (ctx->cb)
+    ctx->cb(conn, false, ctx->req, ctx->resp, ctx->cb_arg);
+  req_put(conn, ctx);
+}
+
+// a disconnected connection is freed in three steps: the cm poller destroys
+// its qp, once a server connection holds no request anymore, then the owning
+// cq poller drains its send queue, which also makes sure that no completion
+// of the connection is still being handled, and at last the cm poller frees
+// it.
+static void connection_free(void *arg) {
+  struct rdma_connection *conn = arg;
+  if (!conn->is_server && conn->u.c.disconnect)
+    conn->u.c.disconnect(conn->u.c.disconnect_arg);
+  if (!conn->is_server)
+    kv_free(conn->u.c.regions);
+  kv_free(conn);
+}
+
+static void ud_client_retire(struct rdma_connection *conn);
+static void stream_retire(struct rdma_connection *conn);
+static void connection_retire(void *arg) {
+  struct rdma_connection *conn = arg;
+  sq_drain(&conn->sq);
+  sq_fini(&conn->sq);
+  if (!conn->is_server) {
+    struct client_req_ctx *ctx;
+    struct cq_poller_ctx *poller = conn->dev->cq_pollers + conn->thread;
+    while ((ctx = STAILQ_FIRST(&conn->u.c.pending))) {
+      STAILQ_REMOVE_HEAD(&conn->u.c.pending, next);
+      ctx->queued = false;
+      pthread_spin_lock(&poller->timer_lock);
+      kv_timer_del(&poller->wheel, &ctx->timer);
+      pthread_spin_unlock(&poller->timer_lock);
+      req_fail(conn, ctx);
+    }
+    while ((ctx = STAILQ_FIRST(&conn->u.c.acks))) {
+      STAILQ_REMOVE_HEAD(&conn->u.c.acks, next);
+      ctx->ack_busy = false;
+      if (ctx->ended)
+        req_put(conn, ctx);
+    }
+    // requests with a deadline are still tracked by the wheel.
+    for (uint32_t i = 0; i < MAX_REQ_NUM; i++) {
+      ctx = kv_mempool_get_ele(conn->u.c.mp, (int64_t)i * conn->u.c.ctx_sz);
+      if (!kv_timer_pending(&ctx->timer))
+        continue;
+      pthread_spin_lock(&poller->timer_lock);
+      kv_timer_del(&poller->wheel, &ctx->timer);
+      pthread_spin_unlock(&poller->timer_lock);
+      req_fail(conn, ctx);
+    }
+    // streams have no deadline.
+    while ((ctx = LIST_FIRST(&conn->u.c.streams)))
+      req_fail(conn, ctx);
+    if (conn->u.c.ud)
+      ud_client_retire(conn);
+    pthread_spin_destroy(&conn->u.c.lock);
+    ibv_dereg_mr(conn->u.c.mp_mr);
+    kv_mempool_free(conn->u.c.mp);
+    kv_mempool_free(conn->u.c.rw_mp);
+  } else {
+    stream_retire(conn);
+    pthread_spin_destroy(&conn->u.s.stream_lock);
+  }
+  kv_app_send(conn->self->thread_id, connection_free, conn);
+}
+
+static void conn_teardown(void *arg) {
+  struct rdma_connection *conn = arg;
+  rdma_destroy_qp(conn->cm_id);
+  rdma_destroy_id(conn->cm_id);
+  kv_app_send(conn->self->thread_id + conn->thread, connection_retire, conn);
+}
+
+// handlers may respond on any thread, a request holds its server connection
+// until its receive buffer is reposted. no reference is taken once the last
+// one is gone.
+static bool conn_get(struct rdma_connection *conn) {
+  uint32_t refs = __atomic_load_n(&conn->u.s.refs, __ATOMIC_RELAXED);
+  do {
+    if (refs == 0)
+      return false;
+  } while (!__atomic_compare_exchange_n(&conn->u.s.refs, &refs, refs + 1,
+                                        true, __ATOMIC_ACQUIRE,
+                                        __ATOMIC_RELAXED));
+  return true;
+}
+
+static void conn_put(struct rdma_connection *conn) {
+  if (__atomic_sub_fetch(&conn->u.s.refs, 1, __ATOMIC_ACQ_REL) == 0)
+    kv_app_send(conn->self->thread_id, conn_teardown, conn);
+}
+
+// a server connection is torn down once its requests are done with, the
+// qp stays in error until then.
+static inline int on_disconnect(struct rdma_cm_id *cm_id) {
+  struct rdma_connection *conn = cm_id->context;
+  struct kv_rdma *self = conn->self;
+  __atomic_store_n(&conn->closing, true, __ATOMIC_RELEASE);
+  if (conn->is_server) {
+    struct sockaddr_in *addr = (struct sockaddr_in *)rdma_get_peer_addr(cm_id);
+    printf("server: peer %s:%u disconnected.\n", inet_ntoa(addr->sin_addr),
+           ntohs(addr->sin_port));
+    __atomic_store_n(self->conns + conn->u.s.slot, NULL, __ATOMIC_RELEASE);
+    self->conn_num--;
+    conn_put(conn);
+    return 0;
+  }
+  conn_teardown(conn);
+  return 0;
+}
+
+static int rdma_cm_poller(void *_self) {
   struct kv_rdma *self = _self;
   struct rdma_cm_event *event = NULL;
   while (self->ec && rdma_get_cm_event(self->ec, &event) == 0) {
     struct rdma_cm_id *cm_id = event->id;
     enum rdma_cm_event_type event_type = event->event;
+    // the private data lives in the event, copy it before acking.
+    uint8_t private_data[256];
+    struct rdma_conn_param param = event->param.conn;
+    struct rdma_ud_param ud_param = event->param.ud;
+    if (param.private_data) {
+      kv_memcpy(private_data, param.private_data, param.private_data_len);
+      param.private_data = private_data;
+    } else {
+      param.private_data_len = 0;
+    }
+    ud_param.private_data = param.private_data;
+    ud_param.private_data_len = param.private_data_len;
+    bool ud = cm_id->ps == RDMA_PS_UDP;
     rdma_ack_cm_event(event);
     switch (event_type) {
     case RDMA_CM_EVENT_ADDR_RESOLVED:
@@ -335,10 +1694,16 @@ static int rdma_cm_poller(void *_self) {
       on_connect_error(self, cm_id);
       break;
     case RDMA_CM_EVENT_CONNECT_REQUEST:
-      on_connect_request(self, cm_id);
+      if (ud)
+        ud_accept(self, cm_id);
+      else
+        on_connect_request(self, cm_id);
       break;
     case RDMA_CM_EVENT_ESTABLISHED:
-      on_established(self, cm_id);
+      if (ud)
+        ud_established(cm_id, &ud_param);
+      else
+        on_established(self, cm_id, &param);
       break;
     case RDMA_CM_EVENT_DISCONNECTED:
       on_disconnect(cm_id);
@@ -347,174 +1712,2683 @@ static int rdma_cm_poller(void *_self) {
       break;
     }
   }
-  return 0;
+  for (uint32_t i = 0; self->ec && i < self->dev_num; i++)
+    if (self->devs[i].cq_pollers)
+      on_async_event(self->devs + i);
+  if (self->ec && self->has_server) {
+    for (uint32_t i = 0; i < self->max_slot; i++)
+      if (self->conns[i])
+        sq_flush_idle(self->conns[i]);
+    for (uint32_t i = 0; i < self->dev_num; i++)
+      if (self->devs[i].requests)
+        srq_shrink(self->devs + i);
+  }
+  return 0;
+}
+
+// --- client ---
+
+void kv_rdma_connect(kv_rdma_handle h, char *addr_str, char *port_str,
+                     kv_rdma_connect_cb connect_cb, void *connect_arg,
+                     kv_rdma_disconnect_cb disconnect_cb,
+                     void *disconnect_arg) {
+  kv_rdma_connect_from(h, NULL, addr_str, port_str, connect_cb, connect_arg,
+                       disconnect_cb, disconnect_arg);
+}
+
+static void client_connect(struct kv_rdma *self, char *src_addr_str,
+                           char *addr_str, char *port_str,
+                           enum rdma_port_space ps,
+                           kv_rdma_connect_cb connect_cb, void *connect_arg,
+                           kv_rdma_disconnect_cb disconnect_cb,
+                           void *disconnect_arg) {
+  struct rdma_connection *conn = kv_malloc(sizeof(struct rdma_connection));
+  *conn = (struct rdma_connection){self, NULL, NULL, 0, false};
+  conn->u.c.connect = connect_cb;
+  conn->u.c.connect_arg = connect_arg;
+  conn->u.c.disconnect = disconnect_cb;
+  conn->u.c.disconnect_arg = disconnect_arg;
+  conn->u.c.ctx_sz =
+      (sizeof(struct client_req_ctx) + self->inline_threshold + 7) & ~7U;
+  conn->u.c.mp = kv_mempool_create(MAX_REQ_NUM, conn->u.c.ctx_sz);
+  conn->u.c.rw_mp = kv_mempool_create(MAX_Q_NUM, sizeof(struct rw_ctx));
+  for (uint32_t i = 0; i < MAX_REQ_NUM; i++) {
+    struct client_req_ctx *ctx =
+        kv_mempool_get_ele(conn->u.c.mp, (int64_t)i * conn->u.c.ctx_sz);
+    kv_timer_init(&ctx->timer);
+    ctx->gen = 0;
+  }
+  pthread_spin_init(&conn->u.c.lock, PTHREAD_PROCESS_PRIVATE);
+  STAILQ_INIT(&conn->u.c.pending);
+  STAILQ_INIT(&conn->u.c.acks);
+  LIST_INIT(&conn->u.c.streams);
+  struct addrinfo *addr, *src = NULL;
+  TEST_NZ(getaddrinfo(addr_str, port_str, NULL, &addr));
+  // the local address picks the device, and so the rail, of the connection.
+  if (src_addr_str)
+    TEST_NZ(getaddrinfo(src_addr_str, NULL, NULL, &src));
+  TEST_NZ(rdma_create_id(self->ec, &conn->cm_id, NULL, ps));
+  conn->cm_id->context = conn;
+  TEST_NZ(rdma_resolve_addr(conn->cm_id, src ? src->ai_addr : NULL,
+                            addr->ai_addr, TIMEOUT_IN_MS));
+  freeaddrinfo(addr);
+  if (src)
+    freeaddrinfo(src);
+}
+
+void kv_rdma_connect_from(kv_rdma_handle h, char *src_addr_str,
+                          char *addr_str, char *port_str,
+                          kv_rdma_connect_cb connect_cb, void *connect_arg,
+                          kv_rdma_disconnect_cb disconnect_cb,
+                          void *disconnect_arg) {
+  client_connect(h, src_addr_str, addr_str, port_str, RDMA_PS_TCP, connect_cb,
+                 connect_arg, disconnect_cb, disconnect_arg);
+}
+
+void kv_rdma_connect_ud(kv_rdma_handle h, char *addr_str, char *port_str,
+                        kv_rdma_connect_cb connect_cb, void *connect_arg,
+                        kv_rdma_disconnect_cb disconnect_cb,
+                        void *disconnect_arg) {
+  client_connect(h, NULL, addr_str, port_str, RDMA_PS_UDP, connect_cb,
+                 connect_arg, disconnect_cb, disconnect_arg);
+}
+
+// --- connection groups ---
+// the connections of a group are made and torn down on the cm poller's
+// thread, which runs all their connect and disconnect callbacks.
+struct rdma_group {
+  struct kv_rdma *self;
+  struct kv_rdma_group_opts opts;
+  kv_rdma_group_connect_cb connect;
+  void *connect_arg;
+  kv_rdma_disconnect_cb disconnect;
+  void *disconnect_arg;
+  uint32_t num;     // connections asked for
+  uint32_t pending; // connections not established nor failed yet
+  uint32_t live;    // established connections not freed yet
+  bool failed;
+  uint32_t next; // round-robin cursor, updated atomically
+  struct group_member *members;
+  // at the index of their member, NULL until connected and once freed.
+  struct rdma_connection *conns[];
+};
+// the connection callbacks of a member know its index, so that the rails
+// alternate in conns whatever the order the connections complete in.
+struct group_member {
+  struct rdma_group *group;
+  uint32_t index;
+};
+
+void kv_rdma_group_opts_init(struct kv_rdma_group_opts *opts) {
+  opts->qps = 1;
+  opts->policy = KV_RDMA_GROUP_ROUND_ROBIN;
+  opts->hash = NULL;
+  opts->hash_arg = NULL;
+}
+
+static void group_free(struct rdma_group *group) {
+  kv_free(group->members);
+  kv_free(group);
+}
+
+static void group_on_disconnect(void *arg) {
+  struct group_member *member = arg;
+  struct rdma_group *group = member->group;
+  __atomic_store_n(group->conns + member->index, NULL, __ATOMIC_RELEASE);
+  if (--group->live)
+    return;
+  // a group which failed to connect was never handed out.
+  if (!group->failed && group->disconnect)
+    group->disconnect(group->disconnect_arg);
+  group_free(group);
+}
+
+static void group_on_connect(connection_handle h, void *arg) {
+  struct group_member *member = arg;
+  struct rdma_group *group = member->group;
+  if (h) {
+    __atomic_store_n(group->conns + member->index, h, __ATOMIC_RELEASE);
+    group->live++;
+  } else {
+    group->failed = true;
+  }
+  if (--group->pending)
+    return;
+  if (!group->failed) {
+    group->connect(group, group->connect_arg);
+    return;
+  }
+  group->connect(NULL, group->connect_arg);
+  if (group->live == 0) {
+    group_free(group);
+    return;
+  }
+  for (uint32_t i = 0; i < group->num; i++)
+    if (group->conns[i])
+      kv_rdma_disconnect(group->conns[i]);
+}
+
+void kv_rdma_group_connect(kv_rdma_handle h, char **src_addrs,
+                           uint32_t src_num, char *addr_str, char *port_str,
+                           const struct kv_rdma_group_opts *opts,
+                           kv_rdma_group_connect_cb connect_cb,
+                           void *connect_arg,
+                           kv_rdma_disconnect_cb disconnect_cb,
+                           void *disconnect_arg) {
+  struct kv_rdma *self = h;
+  struct kv_rdma_group_opts default_opts;
+  if (opts == NULL) {
+    kv_rdma_group_opts_init(&default_opts);
+    opts = &default_opts;
+  }
+  uint32_t rails = src_num ? src_num : 1;
+  uint32_t qps = opts->qps ? opts->qps : 1;
+  uint32_t num = rails * qps;
+  struct rdma_group *group = kv_calloc(
+      1, sizeof(struct rdma_group) + num * sizeof(struct rdma_connection *));
+  *group = (struct rdma_group){self, *opts, connect_cb, connect_arg,
+                               disconnect_cb, disconnect_arg, num, num};
+  group->members = kv_calloc(num, sizeof(struct group_member));
+  if (group->opts.policy == KV_RDMA_GROUP_HASH && group->opts.hash == NULL)
+    group->opts.policy = KV_RDMA_GROUP_ROUND_ROBIN;
+  // the rails alternate, so that consecutive picks of round-robin use them
+  // all.
+  for (uint32_t i = 0; i < num; i++) {
+    group->members[i] = (struct group_member){group, i};
+    kv_rdma_connect_from(h, src_num ? src_addrs[i % rails] : NULL, addr_str,
+                         port_str, group_on_connect, group->members + i,
+                         group_on_disconnect, group->members + i);
+  }
+}
+
+// the connection of member i, NULL once it is torn down.
+static struct rdma_connection *group_member(struct rdma_group *group,
+                                            uint32_t i) {
+  struct rdma_connection *conn =
+      __atomic_load_n(group->conns + i % group->num, __ATOMIC_ACQUIRE);
+  if (conn && __atomic_load_n(&conn->closing, __ATOMIC_ACQUIRE))
+    return NULL;
+  return conn;
+}
+
+// the first live connection from member i on.
+static struct rdma_connection *group_next(struct rdma_group *group,
+                                          uint32_t i) {
+  for (uint32_t j = 0; j < group->num; j++) {
+    struct rdma_connection *conn = group_member(group, i + j);
+    if (conn)
+      return conn;
+  }
+  return NULL;
+}
+
+// the connection with the fewest requests in flight, scanning from the
+// round-robin cursor so that ties are spread.
+static struct rdma_connection *group_least(struct rdma_group *group) {
+  uint32_t start = __atomic_fetch_add(&group->next, 1, __ATOMIC_RELAXED);
+  struct rdma_connection *best = NULL;
+  uint32_t min = UINT32_MAX;
+  for (uint32_t i = 0; i < group->num && min; i++) {
+    struct rdma_connection *conn = group_member(group, start + i);
+    if (conn == NULL)
+      continue;
+    uint32_t n = __atomic_load_n(&conn->u.c.outstanding, __ATOMIC_RELAXED);
+    if (n < min) {
+      min = n;
+      best = conn;
+    }
+  }
+  return best;
+}
+
+connection_handle kv_rdma_group_pick(kv_rdma_group_handle h,
+                                     const struct kv_rdma_req *req) {
+  struct rdma_group *group = h;
+  uint32_t i;
+  switch (group->opts.policy) {
+  case KV_RDMA_GROUP_LEAST_OUTSTANDING:
+    return group_least(group);
+  case KV_RDMA_GROUP_HASH:
+    if (req) {
+      i = group->opts.hash(req, group->opts.hash_arg);
+      break;
+    }
+    // fall through
+  default:
+    i = __atomic_fetch_add(&group->next, 1, __ATOMIC_RELAXED);
+    break;
+  }
+  // a dead member passes its requests on to the next live one.
+  return group_next(group, i);
+}
+
+uint32_t kv_rdma_group_size(kv_rdma_group_handle h) {
+  return ((struct rdma_group *)h)->num;
+}
+
+connection_handle kv_rdma_group_conn(kv_rdma_group_handle h, uint32_t index) {
+  return group_member(h, index);
+}
+
+void kv_rdma_group_send_req(kv_rdma_group_handle h, kv_rdma_mr req,
+                            uint32_t req_sz, kv_rdma_mr resp, void *resp_addr,
+                            kv_rdma_req_cb cb, void *cb_arg) {
+  struct kv_rdma_req r = {req, req_sz, resp, resp_addr, cb, cb_arg};
+  kv_rdma_group_send_req_batch(h, &r, 1);
+}
+
+void kv_rdma_group_send_req_batch(kv_rdma_group_handle h,
+                                  struct kv_rdma_req *reqs, uint32_t num) {
+  if (num == 0)
+    return;
+  connection_handle conn = kv_rdma_group_pick(h, reqs);
+  if (conn) {
+    kv_rdma_send_req_batch(conn, reqs, num);
+    return;
+  }
+  for (uint32_t i = 0; i < num; i++)
+    if (reqs[i].cb)
+      reqs[i].cb(NULL, false, reqs[i].req, reqs[i].resp, reqs[i].cb_arg);
+}
+
+void kv_rdma_group_disconnect(kv_rdma_group_handle h) {
+  struct rdma_group *group = h;
+  for (uint32_t i = 0; i < group->num; i++) {
+    struct rdma_connection *conn = group_member(group, i);
+    if (conn)
+      kv_rdma_disconnect(conn);
+  }
+}
+
+// a one-way message is done with once its send is reclaimed, and so is the
+// acknowledgement of a stream. their wr_id is tagged.
+#define WR_ONEWAY (1U)
+#define WR_STREAM_ACK (2U)
+#define WR_TAGS (3U)
+static void flush_reqs(struct rdma_connection *conn);
+static void on_ack_sent(struct client_req_ctx *ctx, bool success);
+static void msg_sent(struct client_req_ctx *ctx, bool success) {
+  struct rdma_connection *conn = ctx->conn;
+  // without flow control, the credit is given back like a response does.
+  if (conn->u.c.peer.credits == 0) {
+    pthread_spin_lock(&conn->u.c.lock);
+    conn->u.c.credits++;
+    pthread_spin_unlock(&conn->u.c.lock);
+  }
+  if (ctx->cb)
+    ctx->cb(conn, success, ctx->req, NULL, ctx->cb_arg);
+  req_put(conn, ctx);
+  // sends fail when the qp is gone, while the connection is retired.
+  if (success && !STAILQ_EMPTY(&conn->u.c.pending))
+    flush_reqs(conn);
+}
+
+static void on_send_req(void *ctx, bool success) {
+  if (!success) {
+    fprintf(stderr, "on_send_req: send failed.\n");
+  }
+  struct client_req_ctx *req =
+      (struct client_req_ctx *)((uintptr_t)ctx & ~(uintptr_t)WR_TAGS);
+  if ((uintptr_t)ctx & WR_ONEWAY)
+    msg_sent(req, success);
+  else if ((uintptr_t)ctx & WR_STREAM_ACK)
+    on_ack_sent(req, success);
+}
+
+// at most MAX_BATCH_SIZE requests are chained into one ibv_post_send, larger
+// batches are split into several chains.
+#define MAX_BATCH_SIZE (32U)
+// fill the sg list of a request and return the number of its segments, or 0
+// if it can't be sent. the payload is replaced by a rendezvous descriptor if
+// it does not fit the server's receive buffers.
+static uint32_t build_req(struct rdma_connection *conn,
+                          struct kv_rdma_req *req, struct client_req_ctx *ctx,
+                          struct req_header *header, struct ibv_sge *sges,
+                          uint32_t *len) {
+  struct ibv_mr *req_mr = req->req;
+  uint32_t payload = req->sge_num ? 0 : req->req_sz;
+  for (uint32_t j = 0; j < req->sge_num; j++)
+    payload += req->sges[j].length;
+  uint32_t threshold = conn->u.c.peer.max_msg_sz < conn->self->rndv_threshold
+                           ? conn->u.c.peer.max_msg_sz
+                           : conn->self->rndv_threshold;
+  if (payload <= threshold) {
+    if (req->sge_num + 1 > conn->max_sge)
+      return 0;
+    uint32_t header_len =
+        req->sge_num ? HEADER_SIZE : req->req_sz + HEADER_SIZE;
+    sges[0] = (struct ibv_sge){(uintptr_t)req_mr->addr, header_len,
+                               mr_lkey(req_mr, conn->dev)};
+    for (uint32_t j = 0; j < req->sge_num; j++) {
+      struct kv_rdma_sge *sge = req->sges + j;
+      struct ibv_mr *mr = sge->mr;
+      assert(sge->offset + sge->length <= mr->length);
+      sges[j + 1] = (struct ibv_sge){(uintptr_t)mr->addr + sge->offset,
+                                     sge->length, mr_lkey(mr, conn->dev)};
+    }
+    *len = HEADER_SIZE + payload;
+    return req->sge_num + 1;
+  }
+  // the server may read a one-way message after its send completes.
+  if (payload > conn->u.c.peer.max_rndv_sz || conn->max_sge < 2 ||
+      req->oneway)
+    return 0;
+  struct rndv_desc *desc = &ctx->desc;
+  desc->len = payload;
+  desc->sge_num = req->sge_num ? req->sge_num : 1;
+  if (req->sge_num == 0) {
+    desc->sges[0].addr = (uintptr_t)req_mr->addr + HEADER_SIZE;
+    desc->sges[0].rkey = mr_rkey(req_mr, conn->dev);
+    desc->sges[0].length = req->req_sz;
+  }
+  for (uint32_t j = 0; j < req->sge_num; j++) {
+    struct ibv_mr *mr = req->sges[j].mr;
+    desc->sges[j].addr = (uintptr_t)mr->addr + req->sges[j].offset;
+    desc->sges[j].rkey = mr_rkey(mr, conn->dev);
+    desc->sges[j].length = req->sges[j].length;
+  }
+  header->flags |= REQ_RNDV;
+  *len = HEADER_SIZE + RNDV_DESC_SIZE(desc->sge_num);
+  sges[0] = (struct ibv_sge){(uintptr_t)req_mr->addr, HEADER_SIZE,
+                             mr_lkey(req_mr, conn->dev)};
+  sges[1] = (struct ibv_sge){(uintptr_t)desc, RNDV_DESC_SIZE(desc->sge_num),
+                             conn->u.c.mp_mr->lkey};
+  STATS(conn->self)->rndv_reqs++;
+  return 2;
+}
+
+// the deadlines run from the submission, a request waiting for credits
+// expires too.
+static void arm_reqs(struct rdma_connection *conn,
+                     struct client_req_ctx **ctxs, uint32_t cnt) {
+  struct cq_poller_ctx *poller = conn->dev->cq_pollers + conn->thread;
+  uint64_t now = 0;
+  for (uint32_t i = 0; i < cnt; i++) {
+    if (ctxs[i]->timeout_ms == 0)
+      continue;
+    if (now == 0) {
+      now = now_ms();
+      pthread_spin_lock(&poller->timer_lock);
+    }
+    kv_timer_add(&poller->wheel, &ctxs[i]->timer, now,
+                 now + ctxs[i]->timeout_ms);
+  }
+  if (now)
+    pthread_spin_unlock(&poller->timer_lock);
+}
+
+// post prepared requests, in chains of at most MAX_BATCH_SIZE. the credits of
+// the requests which fail to be posted are given back.
+static void post_reqs(struct rdma_connection *conn,
+                      struct client_req_ctx **ctxs, uint32_t cnt) {
+  struct ibv_send_wr s_wrs[MAX_BATCH_SIZE];
+  struct cq_poller_ctx *poller = conn->dev->cq_pollers + conn->thread;
+  uint32_t posted;
+  assert(cnt && cnt <= MAX_BATCH_SIZE);
+  uint32_t last_msg = cnt;
+  for (uint32_t i = 0; i < cnt; i++) {
+    struct client_req_ctx *ctx = ctxs[i];
+    memset(s_wrs + i, 0, sizeof(struct ibv_send_wr));
+    s_wrs[i].wr_id = (uintptr_t)ctx | (ctx->oneway ? WR_ONEWAY : 0);
+    s_wrs[i].next = s_wrs + i + 1;
+    s_wrs[i].opcode = IBV_WR_SEND_WITH_IMM;
+    s_wrs[i].imm_data = ctx->resp ? mr_rkey(ctx->resp, conn->dev) : 0;
+    s_wrs[i].sg_list = ctx->sges;
+    s_wrs[i].num_sge = ctx->sge_num;
+    // inline data is copied at post time, the NIC skips the DMA read.
+    if (ctx->len <= conn->max_inline)
+      s_wrs[i].send_flags = IBV_SEND_INLINE;
+    if (ctx->oneway)
+      last_msg = i;
+  }
+  // no response reclaims the sends of one-way messages.
+  if (last_msg < cnt)
+    s_wrs[last_msg].send_flags |= IBV_SEND_SIGNALED;
+  s_wrs[cnt - 1].next = NULL;
+  posted = sq_post(conn, s_wrs, cnt, on_send_req);
+  struct rdma_stats *stats = STATS(conn->self);
+  stats->reqs += posted;
+  for (uint32_t i = 0; i < posted; i++)
+    if (s_wrs[i].send_flags & IBV_SEND_INLINE)
+      stats->inline_reqs++;
+  if (posted == cnt)
+    return;
+  pthread_spin_lock(&conn->u.c.lock);
+  conn->u.c.credits += cnt - posted;
+  pthread_spin_unlock(&conn->u.c.lock);
+  pthread_spin_lock(&poller->timer_lock);
+  for (uint32_t i = posted; i < cnt; i++) {
+    // unless it has expired in the meantime.
+    if (ctxs[i]->timeout_ms && !kv_timer_pending(&ctxs[i]->timer))
+      ctxs[i] = NULL;
+    else
+      kv_timer_del(&poller->wheel, &ctxs[i]->timer);
+  }
+  pthread_spin_unlock(&poller->timer_lock);
+  for (uint32_t i = posted; i < cnt; i++)
+    if (ctxs[i])
+      req_fail(conn, ctxs[i]);
+}
+
+// post the queued requests the credits allow.
+static void flush_reqs(struct rdma_connection *conn) {
+  struct client_req_ctx *ctxs[MAX_BATCH_SIZE];
+  uint32_t cnt;
+  do {
+    cnt = 0;
+    pthread_spin_lock(&conn->u.c.lock);
+    while (cnt < MAX_BATCH_SIZE && conn->u.c.credits &&
+           !STAILQ_EMPTY(&conn->u.c.pending)) {
+      ctxs[cnt] = STAILQ_FIRST(&conn->u.c.pending);
+      STAILQ_REMOVE_HEAD(&conn->u.c.pending, next);
+      ctxs[cnt++]->queued = false;
+      conn->u.c.credits--;
+    }
+    pthread_spin_unlock(&conn->u.c.lock);
+    if (cnt)
+      post_reqs(conn, ctxs, cnt);
+  } while (cnt == MAX_BATCH_SIZE);
+}
+
+// a queued request is posted after the send call returns, copy the payload
+// which would have been inlined so its buffers may still be reused at once.
+static void queue_req(struct rdma_connection *conn,
+                      struct client_req_ctx *ctx) {
+  if (ctx->len <= conn->max_inline) {
+    uint8_t *data = ctx->inline_data;
+    for (uint32_t j = 0; j < ctx->sge_num; j++) {
+      kv_memcpy(data, (void *)(uintptr_t)ctx->sges[j].addr,
+                ctx->sges[j].length);
+      data += ctx->sges[j].length;
+    }
+    ctx->sges[0] =
+        (struct ibv_sge){(uintptr_t)ctx->inline_data, ctx->len, 0};
+    ctx->sge_num = 1;
+  }
+  STAILQ_INSERT_TAIL(&conn->u.c.pending, ctx, next);
+  ctx->queued = true;
+}
+
+// --- client streams ---
+struct stream_args {
+  kv_rdma_chunk_cb cb;
+  uint32_t slot_sz, slot_num;
+};
+
+// append the ring to a stream request built by build_req, and account for
+// its slots. returns the new number of segments, or 0 if it can't be sent.
+static uint32_t stream_prepare(struct rdma_connection *conn,
+                               struct client_req_ctx *ctx,
+                               struct req_header *header,
+                               const struct stream_args *stream,
+                               uint32_t sge_num) {
+  if ((header->flags & REQ_RNDV) || sge_num + 1 > conn->max_sge ||
+      ctx->len + STREAM_DESC_SIZE > HEADER_SIZE + conn->u.c.peer.max_msg_sz ||
+      stream->slot_num == 0 || stream->slot_sz == 0)
+    return 0;
+  pthread_spin_lock(&conn->u.c.lock);
+  bool room = conn->u.c.stream_slots + stream->slot_num <= MAX_STREAM_SLOTS;
+  if (room) {
+    conn->u.c.stream_slots += stream->slot_num;
+    LIST_INSERT_HEAD(&conn->u.c.streams, ctx, stream_entry);
+  }
+  pthread_spin_unlock(&conn->u.c.lock);
+  if (!room)
+    return 0;
+  header->flags |= REQ_STREAM;
+  ctx->chunk_cb = stream->cb;
+  ctx->sdesc = (struct stream_desc){stream->slot_sz, stream->slot_num};
+  ctx->timeout_ms = 0;
+  ctx->resp_buf = (uint8_t *)(uintptr_t)header->resp_addr;
+  ctx->sges[sge_num] = (struct ibv_sge){
+      (uintptr_t)&ctx->sdesc, STREAM_DESC_SIZE, conn->u.c.mp_mr->lkey};
+  ctx->len += STREAM_DESC_SIZE;
+  return sge_num + 1;
+}
+
+// the stream is over, its ctx is freed once no acknowledgement is in flight.
+static void stream_end(struct rdma_connection *conn,
+                       struct client_req_ctx *ctx) {
+  pthread_spin_lock(&conn->u.c.lock);
+  LIST_REMOVE(ctx, stream_entry);
+  conn->u.c.stream_slots -= ctx->sdesc.slot_num;
+  bool busy = ctx->ack_busy;
+  ctx->ended = busy;
+  pthread_spin_unlock(&conn->u.c.lock);
+  if (!busy)
+    req_put(conn, ctx);
+}
+
+static void stream_fail(struct rdma_connection *conn,
+                        struct client_req_ctx *ctx) {
+  ctx->chunk_cb(conn, false, ctx, NULL, 0, true, ctx->cb_arg);
+  stream_end(conn, ctx);
+}
+
+// chunks fill the slots of the ring in turn.
+static void on_recv_chunk(struct rdma_connection *conn,
+                          struct client_req_ctx *ctx, struct ibv_wc *wc) {
+  bool last = wc->imm_data & IMM_LAST;
+  uint32_t slot = ctx->seq++ % ctx->sdesc.slot_num;
+  uint8_t *chunk = ctx->resp_buf + (uint64_t)slot * ctx->sdesc.slot_sz;
+  ctx->chunk_cb(conn, wc->status == IBV_WC_SUCCESS, ctx, chunk, wc->byte_len,
+                last, ctx->cb_arg);
+  if (last)
+    stream_end(conn, ctx);
+}
+
+// tell the server how many slots have been consumed in all.
+static void stream_ack_post(struct rdma_connection *conn,
+                            struct client_req_ctx *ctx, uint32_t acked) {
+  struct ibv_sge sge = {(uintptr_t)&ctx->ack, HEADER_SIZE,
+                        conn->u.c.mp_mr->lkey};
+  struct ibv_send_wr wr;
+  ctx->ack = (struct req_header){
+      acked,
+      REQ_ID(kv_mempool_get_id(conn->u.c.mp, ctx) / conn->u.c.ctx_sz,
+             ctx->gen),
+      (uint16_t)conn->u.c.peer.conn_slot, REQ_STREAM_ACK};
+  memset(&wr, 0, sizeof(wr));
+  wr.wr_id = (uintptr_t)ctx | WR_STREAM_ACK;
+  wr.opcode = IBV_WR_SEND_WITH_IMM;
+  wr.sg_list = &sge;
+  wr.num_sge = 1;
+  wr.send_flags = IBV_SEND_SIGNALED;
+  if (HEADER_SIZE <= conn->max_inline)
+    wr.send_flags |= IBV_SEND_INLINE;
+  if (sq_post(conn, &wr, 1, on_send_req) != 1) {
+    fprintf(stderr, "kv_rdma_stream_ack: fail to post.\n");
+    if (conn->u.c.peer.credits) {
+      pthread_spin_lock(&conn->u.c.lock);
+      conn->u.c.credits++;
+      pthread_spin_unlock(&conn->u.c.lock);
+    }
+    on_ack_sent(ctx, false);
+  }
+}
+
+// an acknowledgement takes a receive buffer of the server, and so a credit
+// when the server has flow control. without one it waits in acks, under the
+// lock. returns whether it may be sent.
+static bool ack_credit(struct rdma_connection *conn,
+                       struct client_req_ctx *ctx) {
+  if (conn->u.c.peer.credits == 0)
+    return true;
+  if (conn->u.c.credits) {
+    conn->u.c.credits--;
+    return true;
+  }
+  STAILQ_INSERT_TAIL(&conn->u.c.acks, ctx, next);
+  return false;
+}
+
+// send the acknowledgements which waited for credits, ahead of the requests
+// as they free the rings of streams.
+static void flush_acks(struct rdma_connection *conn) {
+  struct client_req_ctx *ctx;
+  uint32_t acked = 0;
+  bool ended = false;
+  do {
+    pthread_spin_lock(&conn->u.c.lock);
+    ctx = STAILQ_FIRST(&conn->u.c.acks);
+    if (ctx && (ctx->ended || conn->u.c.credits)) {
+      STAILQ_REMOVE_HEAD(&conn->u.c.acks, next);
+      ended = ctx->ended;
+      if (ended) {
+        ctx->ack_busy = false;
+      } else {
+        conn->u.c.credits--;
+        acked = ctx->ack_sent = ctx->acked;
+      }
+    } else {
+      ctx = NULL;
+    }
+    pthread_spin_unlock(&conn->u.c.lock);
+    if (ctx && ended)
+      req_put(conn, ctx);
+    else if (ctx)
+      stream_ack_post(conn, ctx, acked);
+  } while (ctx);
+}
+
+// send the acknowledgements which came in the meantime, at once.
+static void on_ack_sent(struct client_req_ctx *ctx, bool success) {
+  struct rdma_connection *conn = ctx->conn;
+  uint32_t acked = 0;
+  pthread_spin_lock(&conn->u.c.lock);
+  bool more = success && !ctx->ended && ctx->acked != ctx->ack_sent;
+  bool resend = more && ack_credit(conn, ctx);
+  if (resend)
+    acked = ctx->ack_sent = ctx->acked;
+  else if (!more)
+    ctx->ack_busy = false;
+  bool ended = ctx->ended && !more;
+  pthread_spin_unlock(&conn->u.c.lock);
+  if (resend)
+    stream_ack_post(conn, ctx, acked);
+  else if (ended)
+    req_put(conn, ctx);
+}
+
+void kv_rdma_stream_ack(connection_handle h, void *stream, uint32_t slots) {
+  struct rdma_connection *conn = h;
+  struct client_req_ctx *ctx = stream;
+  uint32_t acked = 0;
+  pthread_spin_lock(&conn->u.c.lock);
+  ctx->acked += slots;
+  // an acknowledgement always frees a slot, so a chunk follows it.
+  bool send = !ctx->ack_busy && ctx->acked != ctx->ack_sent;
+  if (send) {
+    ctx->ack_busy = true;
+    send = ack_credit(conn, ctx);
+  }
+  if (send)
+    acked = ctx->ack_sent = ctx->acked;
+  pthread_spin_unlock(&conn->u.c.lock);
+  if (send)
+    stream_ack_post(conn, ctx, acked);
+}
+
+// flags are added to the header of each request, for those of the library.
+static void send_req_chain(struct rdma_connection *conn,
+                           struct kv_rdma_req *reqs, uint32_t num,
+                           const struct stream_args *stream, uint16_t flags) {
+  struct client_req_ctx *ctxs[MAX_BATCH_SIZE];
+  uint32_t cnt = 0, direct;
+  for (uint32_t i = 0; i < num; i++) {
+    struct client_req_ctx *ctx = kv_mempool_get(conn->u.c.mp);
+    bool oneway = reqs[i].oneway;
+    struct ibv_mr *resp = oneway ? NULL : reqs[i].resp;
+    bool auto_resp = !oneway && resp == NULL;
+    uint32_t sge_num = 0;
+    if (ctx)
+      __atomic_add_fetch(&conn->u.c.outstanding, 1, __ATOMIC_RELAXED);
+    if (ctx && auto_resp)
+      resp = slab_alloc(conn->self, conn->self->auto_resp_sz,
+                        IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE);
+    if (ctx && (resp || oneway)) {
+      uint16_t gen = ctx->gen;
+      *ctx = (struct client_req_ctx){conn, reqs[i].cb, reqs[i].cb_arg,
+                                     reqs[i].req, resp, auto_resp, oneway,
+                                     gen};
+      // a one-way message has no response to wait for.
+      ctx->timeout_ms =
+          reqs[i].timeout_ms ? reqs[i].timeout_ms : conn->self->req_timeout_ms;
+      if (oneway)
+        ctx->timeout_ms = 0;
+      assert((reqs[i].sge_num ? 0 : reqs[i].req_sz) + HEADER_SIZE <=
+             ctx->req->length);
+      void *resp_addr = oneway             ? NULL
+                        : reqs[i].resp_addr ? reqs[i].resp_addr
+                                            : ctx->resp->addr;
+      struct req_header *header = ctx->req->addr;
+      *header = (struct req_header){
+          (uint64_t)resp_addr,
+          REQ_ID(kv_mempool_get_id(conn->u.c.mp, ctx) / conn->u.c.ctx_sz, gen),
+          (uint16_t)conn->u.c.peer.conn_slot,
+          (uint16_t)((oneway ? REQ_ONEWAY : 0) | flags)};
+      sge_num = build_req(conn, reqs + i, ctx, header, ctx->sges, &ctx->len);
+      if (stream && sge_num)
+        sge_num = stream_prepare(conn, ctx, header, stream, sge_num);
+    }
+    if (sge_num == 0) {
+      if (ctx)
+        req_put(conn, ctx);
+      if (stream)
+        stream->cb(conn, false, NULL, NULL, 0, true, reqs[i].cb_arg);
+      else if (reqs[i].cb)
+        reqs[i].cb(conn, false, reqs[i].req, resp, reqs[i].cb_arg);
+      if (resp && auto_resp)
+        slab_free((struct slab_buf *)resp);
+      continue;
+    }
+    ctx->sge_num = sge_num;
+    ctxs[cnt++] = ctx;
+  }
+  if (cnt == 0)
+    return;
+  // arm the deadlines first, a response may come back before post returns.
+  arm_reqs(conn, ctxs, cnt);
+  // requests go out right away as long as credits are left and none is
+  // queued before them, the others wait for the credits of responses.
+  pthread_spin_lock(&conn->u.c.lock);
+  direct = 0;
+  if (STAILQ_EMPTY(&conn->u.c.pending))
+    direct = cnt < conn->u.c.credits ? cnt : conn->u.c.credits;
+  conn->u.c.credits -= direct;
+  for (uint32_t i = direct; i < cnt; i++)
+    queue_req(conn, ctxs[i]);
+  pthread_spin_unlock(&conn->u.c.lock);
+  if (direct < cnt)
+    STATS(conn->self)->credit_waits += cnt - direct;
+  if (direct)
+    post_reqs(conn, ctxs, direct);
+}
+
+static void ud_send_reqs(struct rdma_connection *conn,
+                         struct kv_rdma_req *reqs, uint32_t num);
+void kv_rdma_send_req_batch(connection_handle h, struct kv_rdma_req *reqs,
+                            uint32_t num) {
+  struct rdma_connection *conn = h;
+  assert(conn->is_server == false);
+  if (conn->u.c.ud) {
+    ud_send_reqs(conn, reqs, num);
+    return;
+  }
+  for (uint32_t i = 0; i < num; i += MAX_BATCH_SIZE)
+    send_req_chain(conn, reqs + i,
+                   num - i < MAX_BATCH_SIZE ? num - i : MAX_BATCH_SIZE, NULL,
+                   0);
+}
+
+void kv_rdma_send_req(connection_handle h, kv_rdma_mr req, uint32_t req_sz,
+                      kv_rdma_mr resp, void *resp_addr, kv_rdma_req_cb cb,
+                      void *cb_arg) {
+  struct kv_rdma_req r = {req, req_sz, resp, resp_addr, cb, cb_arg};
+  kv_rdma_send_req_batch(h, &r, 1);
+}
+
+void kv_rdma_send_req_sg(connection_handle h, kv_rdma_mr req,
+                         struct kv_rdma_sge *sges, uint32_t sge_num,
+                         kv_rdma_mr resp, void *resp_addr, kv_rdma_req_cb cb,
+                         void *cb_arg) {
+  struct kv_rdma_req r = {req, 0, resp, resp_addr, cb, cb_arg, sges, sge_num};
+  kv_rdma_send_req_batch(h, &r, 1);
+}
+
+void kv_rdma_send_msg(connection_handle h, kv_rdma_mr req, uint32_t req_sz,
+                      kv_rdma_req_cb cb, void *cb_arg) {
+  struct kv_rdma_req r = {req, req_sz, NULL, NULL, cb, cb_arg};
+  r.oneway = true;
+  kv_rdma_send_req_batch(h, &r, 1);
+}
+
+void kv_rdma_send_stream(connection_handle h, kv_rdma_mr req, uint32_t req_sz,
+                         kv_rdma_mr ring, void *ring_addr, uint32_t slot_sz,
+                         uint32_t slot_num, kv_rdma_chunk_cb cb, void *cb_arg) {
+  struct rdma_connection *conn = h;
+  struct kv_rdma_req r = {req, req_sz, ring, ring_addr, NULL, cb_arg};
+  struct stream_args stream = {cb, slot_sz, slot_num};
+  assert(conn->is_server == false && ring);
+  if (conn->u.c.ud) {
+    cb(conn, false, NULL, NULL, 0, true, cb_arg);
+    return;
+  }
+  send_req_chain(conn, &r, 1, &stream, 0);
+}
+
+// --- one-sided ---
+static void on_rw_done(void *_ctx, bool success) {
+  struct rw_ctx *ctx = _ctx;
+  kv_rdma_resp_cb cb = ctx->cb;
+  void *cb_arg = ctx->cb_arg;
+  if (!success)
+    fprintf(stderr, "on_rw_done: one-sided operation failed.\n");
+  kv_mempool_put(ctx->conn->u.c.rw_mp, ctx);
+  if (cb)
+    cb(success, cb_arg);
+}
+
+// the last operation of a chain is signaled, its completion reclaims those
+// before it.
+static void rw_chain(struct rdma_connection *conn, struct kv_rdma_rw *ops,
+                     uint32_t num) {
+  struct ibv_send_wr wrs[MAX_BATCH_SIZE];
+  struct ibv_sge sges[MAX_BATCH_SIZE];
+  struct rw_ctx *ctxs[MAX_BATCH_SIZE];
+  assert(num && num <= MAX_BATCH_SIZE);
+  for (uint32_t i = 0; i < num; i++) {
+    struct kv_rdma_rw *op = ops + i;
+    struct ibv_mr *mr = op->mr;
+    bool atomic = op->op == KV_RDMA_CAS || op->op == KV_RDMA_FAA;
+    // no more ops than the send queue holds can be in flight, the pool
+    // runs dry only when the queue is full.
+    if ((ctxs[i] = kv_mempool_get(conn->u.c.rw_mp)) == NULL) {
+      fprintf(stderr, "kv_rdma_rw_batch: send queue full.\n");
+      for (uint32_t j = i; j < num; j++)
+        if (ops[j].cb)
+          ops[j].cb(false, ops[j].cb_arg);
+      num = i;
+      break;
+    }
+    *ctxs[i] = (struct rw_ctx){conn, op->cb, op->cb_arg};
+    assert(atomic || op->offset + op->len <= mr->length);
+    sges[i] = (struct ibv_sge){(uintptr_t)mr->addr + op->offset, op->len,
+                               mr_lkey(mr, conn->dev)};
+    memset(wrs + i, 0, sizeof(struct ibv_send_wr));
+    wrs[i].wr_id = (uintptr_t)ctxs[i];
+    wrs[i].next = wrs + i + 1;
+    wrs[i].sg_list = sges + i;
+    wrs[i].num_sge = 1;
+    if (atomic) {
+      // the old value of the word is read into the segment.
+      assert((op->remote_addr & 7) == 0 && op->offset + 8 <= mr->length);
+      sges[i].length = 8;
+      wrs[i].opcode = op->op == KV_RDMA_CAS ? IBV_WR_ATOMIC_CMP_AND_SWP
+                                            : IBV_WR_ATOMIC_FETCH_AND_ADD;
+      wrs[i].wr.atomic.remote_addr = op->remote_addr;
+      wrs[i].wr.atomic.compare_add = op->compare_add;
+      wrs[i].wr.atomic.swap = op->swap;
+      wrs[i].wr.atomic.rkey = op->rkey;
+      continue;
+    }
+    wrs[i].opcode =
+        op->op == KV_RDMA_READ ? IBV_WR_RDMA_READ : IBV_WR_RDMA_WRITE;
+    wrs[i].wr.rdma.remote_addr = op->remote_addr;
+    wrs[i].wr.rdma.rkey = op->rkey;
+    if (op->op == KV_RDMA_WRITE && op->len <= conn->max_inline)
+      wrs[i].send_flags = IBV_SEND_INLINE;
+  }
+  if (num == 0)
+    return;
+  wrs[num - 1].send_flags |= IBV_SEND_SIGNALED;
+  uint32_t posted = conn->u.c.ud ? 0 : sq_post(conn, wrs, num, on_rw_done);
+  if (posted < num)
+    fprintf(stderr, "kv_rdma_rw_batch: fail to post.\n");
+  for (uint32_t i = posted; i < num; i++)
+    on_rw_done(ctxs[i], false);
+}
+
+void kv_rdma_rw_batch(connection_handle h, struct kv_rdma_rw *ops,
+                      uint32_t num) {
+  struct rdma_connection *conn = h;
+  assert(conn->is_server == false);
+  for (uint32_t i = 0; i < num; i += MAX_BATCH_SIZE)
+    rw_chain(conn, ops + i,
+             num - i < MAX_BATCH_SIZE ? num - i : MAX_BATCH_SIZE);
+}
+
+void kv_rdma_read(connection_handle h, kv_rdma_mr mr, uint32_t offset,
+                  uint32_t len, uint64_t remote_addr, uint32_t rkey,
+                  kv_rdma_resp_cb cb, void *cb_arg) {
+  struct kv_rdma_rw op = {KV_RDMA_READ, mr, offset, len, remote_addr, rkey,
+                          cb, cb_arg};
+  kv_rdma_rw_batch(h, &op, 1);
+}
+
+void kv_rdma_write(connection_handle h, kv_rdma_mr mr, uint32_t offset,
+                   uint32_t len, uint64_t remote_addr, uint32_t rkey,
+                   kv_rdma_resp_cb cb, void *cb_arg) {
+  struct kv_rdma_rw op = {KV_RDMA_WRITE, mr, offset, len, remote_addr, rkey,
+                          cb, cb_arg};
+  kv_rdma_rw_batch(h, &op, 1);
+}
+
+void kv_rdma_cmp_swap(connection_handle h, kv_rdma_mr mr, uint32_t offset,
+                      uint64_t remote_addr, uint32_t rkey, uint64_t compare,
+                      uint64_t swap, kv_rdma_resp_cb cb, void *cb_arg) {
+  struct kv_rdma_rw op = {KV_RDMA_CAS, mr, offset, 8, remote_addr, rkey, cb,
+                          cb_arg, compare, swap};
+  kv_rdma_rw_batch(h, &op, 1);
+}
+
+void kv_rdma_fetch_add(connection_handle h, kv_rdma_mr mr, uint32_t offset,
+                       uint64_t remote_addr, uint32_t rkey, uint64_t add,
+                       kv_rdma_resp_cb cb, void *cb_arg) {
+  struct kv_rdma_rw op = {KV_RDMA_FAA, mr, offset, 8, remote_addr, rkey, cb,
+                          cb_arg, add};
+  kv_rdma_rw_batch(h, &op, 1);
+}
+
+// --- region directory ---
+static void conn_connected(void *arg) {
+  struct rdma_connection *conn = arg;
+  if (conn->u.c.connect)
+    conn->u.c.connect(conn, conn->u.c.connect_arg);
+}
+
+// the directory arrives on the cq poller of the connection, the connect
+// callback is always sent to the thread of kv_rdma_init, whether the server
+// exported regions or not.
+static void conn_ready(struct rdma_connection *conn) {
+  kv_app_send(conn->self->thread_id, conn_connected, conn);
+}
+
+static void dir_done(connection_handle h, bool success, kv_rdma_mr req,
+                     kv_rdma_mr resp, __attribute__((unused)) void *cb_arg) {
+  struct rdma_connection *conn = h;
+  uint32_t max = conn->u.c.region_num;
+  conn->u.c.region_num = 0;
+  if (success) {
+    // the server may send fewer regions than asked for, the rest of the
+    // buffer stays zeroed.
+    const struct kv_rdma_region *regions =
+        (const struct kv_rdma_region *)kv_rdma_get_resp_buf(resp);
+    uint32_t num = 0;
+    while (num < max && regions[num].name[0])
+      num++;
+    conn->u.c.regions = kv_calloc(num, sizeof(struct kv_rdma_region));
+    kv_memcpy(conn->u.c.regions, regions, num * sizeof(*regions));
+    conn->u.c.region_num = num;
+    kv_rdma_free_mr(resp);
+  } else {
+    // a late response may still be written into resp, it is not reused.
+    fprintf(stderr, "kv_rdma: fail to get the regions of the server.\n");
+  }
+  kv_rdma_free_mr(req);
+  conn_ready(conn);
+}
+
+// ask the server for its directory, as an ordinary request. until the
+// response, region_num is the number of regions asked for.
+static void dir_fetch(struct rdma_connection *conn) {
+  struct kv_rdma *self = conn->self;
+  uint32_t max = conn->u.c.peer.export_num < KV_RDMA_MAX_EXPORTS
+                     ? conn->u.c.peer.export_num
+                     : KV_RDMA_MAX_EXPORTS;
+  uint32_t size = max * sizeof(struct kv_rdma_region);
+  kv_rdma_mr req = kv_rdma_alloc_req(self, sizeof(uint32_t));
+  kv_rdma_mr resp = kv_rdma_alloc_resp(self, size);
+  if (req == NULL || resp == NULL) {
+    fprintf(stderr, "kv_rdma: no buffer for the directory request.\n");
+    if (req)
+      kv_rdma_free_mr(req);
+    if (resp)
+      kv_rdma_free_mr(resp);
+    conn_ready(conn);
+    return;
+  }
+  kv_memcpy(kv_rdma_get_req_buf(req), &max, sizeof(uint32_t));
+  kv_memset(kv_rdma_get_resp_buf(resp), 0, size);
+  conn->u.c.region_num = max;
+  struct kv_rdma_req r = {req, sizeof(uint32_t), resp, NULL, dir_done, NULL};
+  send_req_chain(conn, &r, 1, NULL, REQ_DIRECTORY);
+}
+
+uint32_t kv_rdma_get_regions(connection_handle h,
+                             const struct kv_rdma_region **regions) {
+  struct rdma_connection *conn = h;
+  *regions = conn->u.c.regions;
+  return conn->u.c.region_num;
+}
+
+const struct kv_rdma_region *kv_rdma_find_region(connection_handle h,
+                                                 const char *name) {
+  struct rdma_connection *conn = h;
+  for (uint32_t i = 0; i < conn->u.c.region_num; i++)
+    if (strncmp(conn->u.c.regions[i].name, name, KV_RDMA_NAME_LEN) == 0)
+      return conn->u.c.regions + i;
+  return NULL;
+}
+
+uint32_t kv_rdma_conn_thread(connection_handle h) {
+  struct rdma_connection *conn = h;
+  return conn->self->thread_id + conn->thread;
+}
+
+static void ud_disconnect(void *arg);
+void kv_rdma_disconnect(connection_handle h) {
+  struct rdma_connection *conn = h;
+  if (conn->u.c.ud) {
+    kv_app_send(conn->self->thread_id, ud_disconnect, conn);
+    return;
+  }
+  TEST_NZ(rdma_disconnect(conn->cm_id));
+}
+
+// --- server ---
+void kv_rdma_listen(kv_rdma_handle h, char *addr_str, char *port_str,
+                    uint32_t con_req_num, uint32_t max_msg_sz,
+                    kv_rdma_req_handler handler, void *arg,
+                    kv_rdma_server_init_cb cb, void *cb_arg) {
+  kv_rdma_listen_with_dispatch(h, addr_str, port_str, con_req_num, max_msg_sz,
+                               handler, arg, cb, cb_arg, NULL);
+}
+
+static void dispatch_init(struct kv_rdma *self,
+                          const struct kv_rdma_dispatch *dispatch);
+void kv_rdma_listen_with_dispatch(kv_rdma_handle h, char *addr_str,
+                                  char *port_str, uint32_t con_req_num,
+                                  uint32_t max_msg_sz,
+                                  kv_rdma_req_handler handler, void *arg,
+                                  kv_rdma_server_init_cb cb, void *cb_arg,
+                                  const struct kv_rdma_dispatch *dispatch) {
+  struct kv_rdma *self = h;
+  dispatch_init(self, dispatch);
+  self->has_server = true;
+  self->init_cb = cb;
+  self->init_cb_arg = cb_arg;
+  struct rdma_connection *conn = kv_malloc(sizeof(struct rdma_connection));
+  *conn = (struct rdma_connection){self, NULL, NULL, 0, true};
+  conn->u.s.handler = handler;
+  conn->u.s.arg = arg;
+  struct addrinfo *addr;
+  TEST_NZ(getaddrinfo(addr_str, port_str, NULL, &addr));
+  TEST_NZ(rdma_create_id(self->ec, &conn->cm_id, NULL, RDMA_PS_TCP));
+  TEST_NZ(rdma_bind_addr(conn->cm_id, addr->ai_addr));
+  TEST_NZ(rdma_listen(conn->cm_id, 10));
+  /* backlog=10 is arbitrary  TODO:conn_num*/
+  conn->cm_id->context = conn;
+  freeaddrinfo(addr);
+  self->con_req_num = con_req_num;
+  self->max_msg_sz = max_msg_sz;
+  self->conns = kv_calloc(MAX_CONN_NUM, sizeof(struct rdma_connection *));
+  printf("kv rdma listening on %s %s.\n", addr_str, port_str);
+}
+
+void kv_rdma_listen_ud(kv_rdma_handle h, char *addr_str, char *port_str,
+                       uint32_t recv_num, kv_rdma_req_handler handler,
+                       void *arg) {
+  struct kv_rdma *self = h;
+  struct rdma_connection *conn = kv_malloc(sizeof(struct rdma_connection));
+  *conn = (struct rdma_connection){self, NULL, NULL, 0, true};
+  conn->u.s.handler = handler;
+  conn->u.s.arg = arg;
+  struct addrinfo *addr;
+  TEST_NZ(getaddrinfo(addr_str, port_str, NULL, &addr));
+  TEST_NZ(rdma_create_id(self->ec, &conn->cm_id, NULL, RDMA_PS_UDP));
+  TEST_NZ(rdma_bind_addr(conn->cm_id, addr->ai_addr));
+  TEST_NZ(rdma_listen(conn->cm_id, 10));
+  conn->cm_id->context = conn;
+  freeaddrinfo(addr);
+  // the receives of each ud qp, which all the sessions of its thread share.
+  self->ud_recv_num = recv_num && recv_num < MAX_Q_NUM ? recv_num : MAX_Q_NUM;
+  self->ud_sessions = kv_calloc(MAX_CONN_NUM, sizeof(struct ud_session *));
+  printf("kv rdma listening for datagrams on %s %s.\n", addr_str, port_str);
+}
+
+void kv_rdma_set_msg_handler(kv_rdma_handle h, kv_rdma_req_handler handler,
+                             void *arg) {
+  struct kv_rdma *self = h;
+  self->msg_arg = arg;
+  __atomic_store_n(&self->msg_handler, handler, __ATOMIC_RELEASE);
+}
+
+// --- dispatch ---
+static void dispatch_init(struct kv_rdma *self,
+                          const struct kv_rdma_dispatch *dispatch) {
+  if (dispatch == NULL || dispatch->mode == KV_RDMA_DISPATCH_INLINE)
+    return;
+  uint32_t num = dispatch->mode == KV_RDMA_DISPATCH_POOL
+                     ? dispatch->worker_num
+                     : 1;
+  if (num == 0 || dispatch->first_worker + num > kv_app()->task_num) {
+    fprintf(stderr, "kv_rdma: invalid workers, handlers run inline.\n");
+    return;
+  }
+  self->dispatch = dispatch->mode;
+  self->first_worker = dispatch->first_worker;
+  self->worker_num = num;
+  self->worker_load = kv_calloc(num, sizeof(uint32_t));
+}
+
+static void msg_done(struct server_req_ctx *ctx);
+static void handler_run(void *arg) {
+  struct server_req_ctx *ctx = arg;
+  // the ctx may be reused once the response is made, look at it first.
+  bool oneway = ctx->header.flags & REQ_ONEWAY;
+  ctx->handler(ctx, ctx->req_mr, ctx->req_sz, ctx->handler_arg);
+  if (oneway)
+    msg_done(ctx);
+}
+
+// run the handler of a request received in ctx->req_mr, in the cq poller or
+// on a worker thread. a pool request goes to the worker with the fewest
+// requests in its hands, ties are broken round-robin.
+static void dispatch_req(struct server_req_ctx *ctx,
+                         kv_rdma_req_handler handler, void *arg,
+                         uint32_t req_sz) {
+  struct kv_rdma *self = ctx->self;
+  ctx->handler = handler;
+  ctx->handler_arg = arg;
+  ctx->req_sz = req_sz;
+  ctx->worker = NO_WORKER;
+  if (self->dispatch == KV_RDMA_DISPATCH_INLINE) {
+    handler_run(ctx);
+    return;
+  }
+  uint32_t worker = 0;
+  if (self->dispatch == KV_RDMA_DISPATCH_POOL) {
+    uint32_t start =
+        __atomic_fetch_add(&self->next_worker, 1, __ATOMIC_RELAXED);
+    uint32_t min = UINT32_MAX;
+    for (uint32_t i = 0; i < self->worker_num; i++) {
+      uint32_t j = (start + i) % self->worker_num;
+      uint32_t load =
+          __atomic_load_n(self->worker_load + j, __ATOMIC_RELAXED);
+      if (load < min) {
+        min = load;
+        worker = j;
+      }
+    }
+    __atomic_add_fetch(self->worker_load + worker, 1, __ATOMIC_RELAXED);
+    ctx->worker = worker;
+  }
+  kv_app_send(self->first_worker + worker, handler_run, ctx);
+}
+
+// the response is being made, the worker is done with the request.
+static inline void dispatch_done(struct server_req_ctx *ctx) {
+  if (ctx->worker == NO_WORKER)
+    return;
+  __atomic_sub_fetch(ctx->self->worker_load + ctx->worker, 1,
+                     __ATOMIC_RELAXED);
+  ctx->worker = NO_WORKER;
+}
+
+static void on_write_resp_done(void *_ctx, bool success);
+// an inline response is done with once posted, its wr_id is tagged so that
+// its completion leaves the ctx alone.
+#define RESP_INLINE (1U)
+static void on_resp_done(void *ctx, bool success) {
+  if ((uintptr_t)ctx & RESP_INLINE) {
+    if (!success)
+      fprintf(stderr, "on_resp_done: inline write failed.\n");
+    return;
+  }
+  on_write_resp_done(ctx, success);
+}
+
+// at most max credits ride on a response, the rest wait for the next one.
+static uint32_t take_credits(struct rdma_connection *conn, uint32_t *from,
+                             uint32_t max) {
+  if (conn->self->credits == 0)
+    return 0;
+  uint32_t owed = __atomic_load_n(from, __ATOMIC_RELAXED), grant;
+  do {
+    grant = owed < max ? owed : max;
+  } while (!__atomic_compare_exchange_n(from, &owed, owed - grant, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  return grant;
+}
+
+static void on_credit_done(__attribute__((unused)) void *ctx, bool success) {
+  if (!success)
+    fprintf(stderr, "on_credit_done: credit update failed.\n");
+}
+
+// no response carries back the credit of a one-way message, the credits of
+// these messages are sent on their own by a zero-length write once a quarter
+// of the client's credits is owed.
+static void msg_credit(struct rdma_connection *conn) {
+  uint32_t credits = conn->self->credits;
+  uint32_t threshold = credits / 4 ? credits / 4 : 1;
+  if (credits == 0)
+    return;
+  __atomic_add_fetch(&conn->u.s.msg_owed, 1, __ATOMIC_RELAXED);
+  while (__atomic_load_n(&conn->u.s.msg_owed, __ATOMIC_RELAXED) >= threshold) {
+    uint32_t grant =
+        take_credits(conn, &conn->u.s.msg_owed, IMM_MAX_CREDITS);
+    if (grant == 0)
+      return;
+    struct ibv_send_wr wr;
+    memset(&wr, 0, sizeof(wr));
+    wr.opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
+    wr.imm_data = IMM_MAKE(grant, IMM_CREDIT_ONLY);
+    if (sq_post(conn, &wr, 1, on_credit_done) != 1) {
+      fprintf(stderr, "msg_credit: fail to post a credit update.\n");
+      __atomic_add_fetch(&conn->u.s.msg_owed, grant, __ATOMIC_RELAXED);
+      return;
+    }
+  }
+}
+
+// a one-way message frees its receive buffer once its handler returns.
+static void msg_done(struct server_req_ctx *ctx) {
+  dispatch_done(ctx);
+  msg_credit(ctx->conn);
+  on_write_resp_done(ctx, true);
+}
+
+// post a chain of responses of one connection, ctxs[i] is the request of
+// wrs[i].
+static void resp_post(struct rdma_connection *conn, struct ibv_send_wr *wrs,
+                      struct server_req_ctx **ctxs, uint32_t n) {
+  struct rdma_stats *stats = STATS(conn->self);
+  uint32_t posted = sq_post(conn, wrs, n, on_resp_done);
+  if (posted)
+    stats->resp_doorbells++;
+  if (posted < n)
+    fprintf(stderr, "kv_rdma_make_resp: fail to post response.\n");
+  for (uint32_t i = 0; i < n; i++) {
+    if (wrs[i].send_flags & IBV_SEND_INLINE) {
+      // the response has been copied into the WQE, the receive buffer can
+      // be re-posted right away.
+      if (i < posted)
+        stats->inline_resps++;
+      on_write_resp_done(ctxs[i], i < posted);
+    } else if (i >= posted) {
+      on_write_resp_done(ctxs[i], false);
+    }
+  }
+}
+
+static void resp_flush(struct resp_batch *batch) {
+  struct ibv_send_wr chain[MAX_RESP_BATCH];
+  struct server_req_ctx *ctxs[MAX_RESP_BATCH];
+  uint32_t num = batch->num;
+  batch->num = 0;
+  // gather the responses of each connection in order, a taken one is marked
+  // by clearing its ctx.
+  for (uint32_t i = 0; i < num; i++) {
+    if (batch->ctxs[i] == NULL)
+      continue;
+    struct rdma_connection *conn = batch->ctxs[i]->conn;
+    uint32_t n = 0;
+    for (uint32_t j = i; j < num; j++) {
+      if (batch->ctxs[j] == NULL || batch->ctxs[j]->conn != conn)
+        continue;
+      chain[n] = batch->wrs[j];
+      chain[n].next = chain + n + 1;
+      ctxs[n++] = batch->ctxs[j];
+      batch->ctxs[j] = NULL;
+    }
+    resp_post(conn, chain, ctxs, n);
+  }
+}
+
+static void post_resp(struct server_req_ctx *ctx, struct ibv_sge *sges,
+                      uint32_t sge_num, uint32_t resp_sz) {
+  struct rdma_stats *stats = STATS(ctx->self);
+  stats->resps++;
+  if (sge_num > ctx->conn->max_sge) {
+    fprintf(stderr, "kv_rdma_make_resp: too many segments.\n");
+    on_write_resp_done(ctx, false);
+    return;
+  }
+  // stage it if made by a handler run inline by a cq poller.
+  struct resp_batch *batch =
+      polling && ctx->self->resp_delay_us ? &polling->resp : NULL;
+  struct ibv_send_wr wr, *wrp = &wr;
+  if (batch) {
+    if (batch->num == 0)
+      batch->since_us = now_us();
+    kv_memcpy(batch->sges[batch->num], sges, sge_num * sizeof(*sges));
+    sges = batch->sges[batch->num];
+    batch->ctxs[batch->num] = ctx;
+    wrp = batch->wrs + batch->num++;
+  }
+  memset(wrp, 0, sizeof(struct ibv_send_wr));
+  wrp->wr_id = (uintptr_t)ctx;
+  wrp->opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
+  wrp->imm_data = IMM_MAKE(
+      take_credits(ctx->conn, &ctx->conn->u.s.owed, IMM_MAX_CREDITS),
+      ctx->header.req_id);
+  wrp->sg_list = sges;
+  wrp->num_sge = sge_num;
+  wrp->wr.rdma.remote_addr = ctx->header.resp_addr;
+  wrp->wr.rdma.rkey = ctx->resp_rkey;
+  if (resp_sz <= ctx->conn->max_inline) {
+    wrp->wr_id |= RESP_INLINE;
+    wrp->send_flags = IBV_SEND_INLINE;
+  }
+  if (batch == NULL)
+    resp_post(ctx->conn, &wr, &ctx, 1);
+  else if (batch->num == MAX_RESP_BATCH ||
+           now_us() - batch->since_us >= ctx->self->resp_delay_us)
+    resp_flush(batch);
+}
+
+static void ud_make_resp(struct server_req_ctx *ctx, struct ibv_sge *sges,
+                         uint32_t sge_num);
+void kv_rdma_make_resp(void *req_h, uint8_t *resp, uint32_t resp_sz) {
+  struct server_req_ctx *ctx = req_h;
+  dispatch_done(ctx);
+  struct ibv_sge sge = {(uintptr_t)resp, resp_sz,
+                        mr_lkey(ctx->req_mr, ctx->dev)};
+  if (ctx->ud) {
+    ud_make_resp(ctx, &sge, 1);
+    return;
+  }
+  post_resp(ctx, &sge, 1, resp_sz);
+}
+
+void kv_rdma_make_resp_sg(void *req_h, struct kv_rdma_sge *sges,
+                          uint32_t sge_num, kv_rdma_resp_cb cb, void *cb_arg) {
+  struct server_req_ctx *ctx = req_h;
+  struct ibv_sge sg_list[KV_RDMA_MAX_SGE];
+  uint32_t resp_sz = 0;
+  dispatch_done(ctx);
+  ctx->resp_cb = cb;
+  ctx->resp_cb_arg = cb_arg;
+  if (sge_num > KV_RDMA_MAX_SGE) {
+    fprintf(stderr, "kv_rdma_make_resp_sg: too many segments.\n");
+    if (ctx->ud) {
+      ud_make_resp(ctx, NULL, 0);
+      if (cb)
+        cb(false, cb_arg);
+      return;
+    }
+    on_write_resp_done(ctx, false);
+    return;
+  }
+  for (uint32_t i = 0; i < sge_num; i++) {
+    struct ibv_mr *mr = sges[i].mr;
+    assert(sges[i].offset + sges[i].length <= mr->length);
+    sg_list[i] = (struct ibv_sge){(uintptr_t)mr->addr + sges[i].offset,
+                                  sges[i].length, mr_lkey(mr, ctx->dev)};
+    resp_sz += sges[i].length;
+  }
+  if (ctx->ud) {
+    ud_make_resp(ctx, sg_list, sge_num);
+    if (cb)
+      cb(true, cb_arg);
+    return;
+  }
+  post_resp(ctx, sg_list, sge_num, resp_sz);
+}
+
+bool kv_rdma_export(kv_rdma_handle h, const char *name, kv_rdma_mr mr) {
+  struct kv_rdma *self = h;
+  if (name[0] == '\0' || strlen(name) >= KV_RDMA_NAME_LEN)
+    return false;
+  pthread_spin_lock(&self->export_lock);
+  uint32_t i = self->export_num;
+  if (i < KV_RDMA_MAX_EXPORTS) {
+    strcpy(self->exports[i].name, name);
+    self->exports[i].mr = mr;
+    __atomic_store_n(&self->export_num, i + 1, __ATOMIC_RELEASE);
+  }
+  pthread_spin_unlock(&self->export_lock);
+  return i < KV_RDMA_MAX_EXPORTS;
+}
+
+// answer a directory request in the cq poller, with at most as many regions
+// as the client asked for, and as fit the response.
+static void dir_serve(struct server_req_ctx *ctx, uint32_t len) {
+  struct kv_rdma *self = ctx->self;
+  uint32_t max = 0;
+  if (len >= sizeof(uint32_t))
+    kv_memcpy(&max, (uint8_t *)ctx->mr->addr + HEADER_SIZE, sizeof(uint32_t));
+  uint32_t num = __atomic_load_n(&self->export_num, __ATOMIC_ACQUIRE);
+  if (num > max)
+    num = max;
+  uint32_t size = num * sizeof(struct kv_rdma_region);
+  uint8_t *buf = NULL;
+  if (size > self->max_msg_sz)
+    buf = kv_rdma_alloc_large_resp(ctx, size);
+  if (buf == NULL) {
+    buf = (uint8_t *)ctx->mr->addr + HEADER_SIZE;
+    if (size > self->max_msg_sz)
+      num = self->max_msg_sz / sizeof(struct kv_rdma_region);
+  }
+  struct kv_rdma_region *regions = (struct kv_rdma_region *)buf;
+  for (uint32_t i = 0; i < num; i++) {
+    struct ibv_mr *mr = self->exports[i].mr;
+    regions[i] = (struct kv_rdma_region){"", (uintptr_t)mr->addr, mr->length,
+                                         mr_rkey(mr, ctx->dev)};
+    kv_memcpy(regions[i].name, self->exports[i].name, KV_RDMA_NAME_LEN);
+  }
+  ctx->worker = NO_WORKER;
+  kv_rdma_make_resp(ctx, buf, num * sizeof(struct kv_rdma_region));
+}
+
+uint32_t kv_rdma_req_rkey(void *req_h, kv_rdma_mr mr) {
+  struct server_req_ctx *ctx = req_h;
+  return mr_rkey(mr, ctx->dev);
+}
+
+// --- server streams ---
+bool kv_rdma_req_is_stream(void *req_h) {
+  struct server_req_ctx *ctx = req_h;
+  return ctx->ud == NULL && (ctx->header.flags & REQ_STREAM);
+}
+
+static void on_chunk_done(void *_chunk, bool success) {
+  struct stream_chunk *chunk = _chunk;
+  if (!success)
+    fprintf(stderr, "on_chunk_done: write failed.\n");
+  if (chunk->cb)
+    chunk->cb(success && !chunk->dropped, chunk->cb_arg);
+  kv_free(chunk);
+}
+
+#define MAX_STREAM_POST (32U)
+// post the queued chunks of a stream while its ring has free slots, under
+// the stream lock. once a chunk fails to be posted the stream is broken, and
+// the chunks after it are moved to failed. returns true once the stream is
+// over, it is then taken off its connection.
+static bool stream_pump(struct server_req_ctx *ctx,
+                        struct stream_chunk_list *failed) {
+  struct rdma_connection *conn = ctx->conn;
+  struct ibv_send_wr wrs[MAX_STREAM_POST];
+  struct stream_chunk *chunks[MAX_STREAM_POST], *chunk;
+  bool ended = false;
+  uint32_t n;
+  do {
+    uint32_t grant = 0;
+    bool last = false; // the chunks may be freed once posted
+    n = 0;
+    while (!ctx->stream.broken && n < MAX_STREAM_POST &&
+           ctx->stream.sent - ctx->stream.acked < ctx->stream.slot_num &&
+           (chunk = STAILQ_FIRST(&ctx->stream.queue))) {
+      STAILQ_REMOVE_HEAD(&ctx->stream.queue, next);
+      uint32_t slot = ctx->stream.sent++ % ctx->stream.slot_num;
+      struct ibv_send_wr *wr = wrs + n;
+      memset(wr, 0, sizeof(struct ibv_send_wr));
+      wr->wr_id = (uintptr_t)chunk;
+      wr->next = wr + 1;
+      wr->opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
+      // the credits of acknowledgements ride on any chunk, the credit of
+      // the request comes back with the last one.
+      uint32_t credits =
+          take_credits(conn, &conn->u.s.ack_owed, IMM_MAX_CREDITS);
+      wr->imm_data = IMM_STREAM | ctx->header.req_id;
+      if (chunk->last) {
+        grant = take_credits(conn, &conn->u.s.owed, IMM_MAX_CREDITS - credits);
+        credits += grant;
+        wr->imm_data |= IMM_LAST;
+        last = true;
+      }
+      wr->imm_data |= IMM_MAKE(credits, 0);
+      wr->sg_list = &chunk->sge;
+      wr->num_sge = chunk->sge.length ? 1 : 0;
+      wr->wr.rdma.remote_addr =
+          ctx->header.resp_addr + (uint64_t)slot * ctx->stream.slot_sz;
+      wr->wr.rdma.rkey = ctx->resp_rkey;
+      chunks[n++] = chunk;
+    }
+    if (n == 0)
+      break;
+    uint32_t posted = sq_post(conn, wrs, n, on_chunk_done);
+    if (posted == n) {
+      ended = last;
+      continue;
+    }
+    fprintf(stderr, "kv_rdma_stream_write: fail to post a chunk.\n");
+    ctx->stream.broken = true;
+    if (last)
+      __atomic_add_fetch(&conn->u.s.owed, grant, __ATOMIC_RELAXED);
+    for (uint32_t i = posted; i < n; i++) {
+      uint32_t credits = IMM_CREDITS(wrs[i].imm_data);
+      if (wrs[i].imm_data & IMM_LAST)
+        credits -= grant;
+      __atomic_add_fetch(&conn->u.s.ack_owed, credits, __ATOMIC_RELAXED);
+      STAILQ_INSERT_TAIL(failed, chunks[i], next);
+    }
+  } while (n == MAX_STREAM_POST);
+  if (ctx->stream.broken) {
+    STAILQ_CONCAT(failed, &ctx->stream.queue);
+    ended = ctx->stream.closing;
+  }
+  if (ended)
+    LIST_REMOVE(ctx, stream.entry);
+  return ended;
+}
+
+// out of the stream lock, fail the chunks left out by stream_pump and give
+// back the receive buffer of a stream which is over.
+static void stream_settle(struct server_req_ctx *ctx,
+                          struct stream_chunk_list *failed, bool ended,
+                          bool success) {
+  struct stream_chunk *chunk;
+  while ((chunk = STAILQ_FIRST(failed))) {
+    STAILQ_REMOVE_HEAD(failed, next);
+    on_chunk_done(chunk, false);
+  }
+  if (ended)
+    on_write_resp_done(ctx, success);
+}
+
+void kv_rdma_stream_write(void *req_h, kv_rdma_mr mr, uint32_t offset,
+                          uint32_t len, bool last, kv_rdma_resp_cb cb,
+                          void *cb_arg) {
+  struct server_req_ctx *ctx = req_h;
+  struct rdma_connection *conn = ctx->conn;
+  struct ibv_mr *m = mr;
+  assert(kv_rdma_req_is_stream(ctx));
+  struct stream_chunk *chunk = kv_malloc(sizeof(struct stream_chunk));
+  *chunk = (struct stream_chunk){{0, 0, 0}, last, false, cb, cb_arg};
+  if (len) {
+    assert(offset + len <= m->length);
+    chunk->sge = (struct ibv_sge){(uintptr_t)m->addr + offset, len,
+                                  mr_lkey(m, ctx->dev)};
+  }
+  if (len > ctx->stream.slot_sz) {
+    fprintf(stderr, "kv_rdma_stream_write: chunk larger than a slot.\n");
+    if (!last) {
+      on_chunk_done(chunk, false);
+      return;
+    }
+    // the stream still has to be ended.
+    chunk->sge.length = 0;
+    chunk->dropped = true;
+  }
+  if (last)
+    dispatch_done(ctx);
+  struct stream_chunk_list failed = STAILQ_HEAD_INITIALIZER(failed);
+  pthread_spin_lock(&conn->u.s.stream_lock);
+  ctx->stream.closing = last;
+  STAILQ_INSERT_TAIL(&ctx->stream.queue, chunk, next);
+  bool ended = stream_pump(ctx, &failed);
+  bool success = !ctx->stream.broken;
+  pthread_spin_unlock(&conn->u.s.stream_lock);
+  stream_settle(ctx, &failed, ended, success);
+}
+
+// the ring is at the request's resp_addr, and its rkey is the immediate.
+static void stream_start(struct server_req_ctx *ctx, uint32_t len) {
+  struct rdma_connection *conn = ctx->conn;
+  struct stream_desc desc = {0, 0};
+  if (len >= STREAM_DESC_SIZE)
+    kv_memcpy(&desc,
+              (uint8_t *)ctx->mr->addr + HEADER_SIZE + len - STREAM_DESC_SIZE,
+              STREAM_DESC_SIZE);
+  if (desc.slot_sz == 0 || desc.slot_num == 0 ||
+      (ctx->header.flags & REQ_RNDV)) {
+    fprintf(stderr, "stream_start: invalid stream request.\n");
+    on_write_resp_done(ctx, false);
+    return;
+  }
+  ctx->stream.slot_sz = desc.slot_sz;
+  ctx->stream.slot_num = desc.slot_num;
+  ctx->stream.sent = ctx->stream.acked = 0;
+  ctx->stream.closing = ctx->stream.broken = false;
+  STAILQ_INIT(&ctx->stream.queue);
+  pthread_spin_lock(&conn->u.s.stream_lock);
+  LIST_INSERT_HEAD(&conn->u.s.streams, ctx, stream.entry);
+  pthread_spin_unlock(&conn->u.s.stream_lock);
+  dispatch_req(ctx, conn->u.s.handler, conn->u.s.arg, len - STREAM_DESC_SIZE);
+}
+
+// an acknowledgement received in ack frees slots of the ring of its stream.
+// its credit rides on the next chunk, at least the last one is still to
+// come while the stream is live. otherwise it is returned like the credit of
+// a one-way message.
+static void stream_recv_ack(struct server_req_ctx *ack) {
+  struct rdma_connection *conn = ack->conn;
+  struct stream_chunk_list failed = STAILQ_HEAD_INITIALIZER(failed);
+  struct server_req_ctx *ctx;
+  bool ended = false, success = true;
+  pthread_spin_lock(&conn->u.s.stream_lock);
+  LIST_FOREACH(ctx, &conn->u.s.streams, stream.entry)
+    if (ctx->header.req_id == ack->header.req_id)
+      break;
+  if (ctx) {
+    if (conn->self->credits)
+      __atomic_add_fetch(&conn->u.s.ack_owed, 1, __ATOMIC_RELAXED);
+    // only the slots written so far may be acknowledged.
+    uint32_t acked = (uint32_t)ack->header.resp_addr;
+    if (acked - ctx->stream.acked <= ctx->stream.sent - ctx->stream.acked)
+      ctx->stream.acked = acked;
+    ended = stream_pump(ctx, &failed);
+    success = !ctx->stream.broken;
+  }
+  pthread_spin_unlock(&conn->u.s.stream_lock);
+  if (ctx)
+    stream_settle(ctx, &failed, ended, success);
+  else
+    msg_credit(conn);
+  // the ack holds the connection until here.
+  on_write_resp_done(ack, true);
+}
+
+// the chunks of the streams of a retired connection can't be posted anymore.
+static void stream_retire(struct rdma_connection *conn) {
+  struct server_req_ctx *ctx = LIST_FIRST(&conn->u.s.streams), *next;
+  for (; ctx; ctx = next) {
+    struct stream_chunk_list failed = STAILQ_HEAD_INITIALIZER(failed);
+    next = LIST_NEXT(ctx, stream.entry);
+    pthread_spin_lock(&conn->u.s.stream_lock);
+    ctx->stream.broken = true;
+    bool ended = stream_pump(ctx, &failed);
+    pthread_spin_unlock(&conn->u.s.stream_lock);
+    stream_settle(ctx, &failed, ended, false);
+  }
+}
+
+void kv_rdma_get_stats(kv_rdma_handle h, struct kv_rdma_stats *stats) {
+  struct kv_rdma *self = h;
+  kv_memset(stats, 0, sizeof(struct kv_rdma_stats));
+  stats->inline_threshold = self->inline_threshold;
+  stats->max_inline_data = self->max_inline_data;
+  for (size_t i = 0; i < MAX_TASKS_NUM; i++) {
+    stats->reqs += self->stats[i].reqs;
+    stats->inline_reqs += self->stats[i].inline_reqs;
+    stats->rndv_reqs += self->stats[i].rndv_reqs;
+    stats->credit_waits += self->stats[i].credit_waits;
+    stats->timeouts += self->stats[i].timeouts;
+    stats->stale_resps += self->stats[i].stale_resps;
+    stats->cq_sleeps += self->stats[i].cq_sleeps;
+    stats->resps += self->stats[i].resps;
+    stats->inline_resps += self->stats[i].inline_resps;
+    stats->resp_doorbells += self->stats[i].resp_doorbells;
+    stats->ud_retransmits += self->stats[i].ud_retransmits;
+    stats->ring_flushes += self->stats[i].ring_flushes;
+  }
+  pthread_mutex_lock(&self->reg_cache.lock);
+  for (uint32_t i = 0; i < self->dev_num; i++) {
+    stats->srq_bufs += self->devs[i].srq_num;
+    stats->srq_limit_events += self->devs[i].srq_limit_events;
+  }
+  stats->reg_hits = self->reg_cache.hits;
+  stats->reg_misses = self->reg_cache.misses;
+  stats->reg_evictions = self->reg_cache.evictions;
+  pthread_mutex_unlock(&self->reg_cache.lock);
+}
+
+uint32_t kv_rdma_conn_num(kv_rdma_handle h) {
+  struct kv_rdma *self = h;
+  return __atomic_load_n(&self->conn_num, __ATOMIC_RELAXED);
+}
+
+// --- cq_poller ---
+static void srq_flush(struct rdma_device *dev, struct srq_batch *batch) {
+  if (batch->num == 0)
+    return;
+  struct ibv_recv_wr *bad_wr = NULL;
+  batch->wrs[batch->num - 1].next = NULL;
+  TEST_NZ(ibv_post_srq_recv(dev->srq, batch->wrs, &bad_wr));
+  batch->num = 0;
+}
+
+static void srq_repost(struct server_req_ctx *ctx) {
+  struct ibv_mr *mr = ctx->mr;
+  if (ctx->chunk && __atomic_load_n(&ctx->chunk->retiring, __ATOMIC_ACQUIRE)) {
+    __atomic_add_fetch(&ctx->chunk->returned, 1, __ATOMIC_RELEASE);
+    return;
+  }
+  struct ibv_sge sge = {(uint64_t)mr->addr, mr->length,
+                        mr_lkey(mr, ctx->dev)};
+  if (polling == NULL || polling->dev != ctx->dev) {
+    // responses made out of a poll batch are reposted right away.
+    struct ibv_recv_wr wr = {(uint64_t)ctx, NULL, &sge, 1}, *bad_wr = NULL;
+    TEST_NZ(ibv_post_srq_recv(ctx->dev->srq, &wr, &bad_wr));
+    return;
+  }
+  struct srq_batch *batch = &polling->srq;
+  uint32_t i = batch->num++;
+  batch->sges[i] = sge;
+  batch->wrs[i] = (struct ibv_recv_wr){(uint64_t)ctx, batch->wrs + i + 1,
+                                       batch->sges + i, 1};
+  if (batch->num == MAX_SRQ_BATCH)
+    srq_flush(ctx->dev, batch);
 }
 
-// --- client ---
+static void rndv_release(struct kv_rdma *self, struct ibv_mr *mr);
+static void on_write_resp_done(void *_ctx, bool success) {
+  if (!success) {
+    fprintf(stderr, "on_write_resp_done: write failed.\n");
+  }
+  struct server_req_ctx *ctx = _ctx;
+  struct rdma_connection *conn = ctx->conn_ref ? ctx->conn : NULL;
+  if (ctx->resp_cb) {
+    ctx->resp_cb(success, ctx->resp_cb_arg);
+    ctx->resp_cb = NULL;
+  }
+  if (ctx->req_mr != ctx->mr) {
+    rndv_release(ctx->self, ctx->req_mr);
+    ctx->req_mr = ctx->mr;
+  }
+  ctx->conn_ref = false;
+  srq_repost(ctx);
+  if (conn)
+    conn_put(conn);
+}
 
-void kv_rdma_connect(kv_rdma_handle h, char *addr_str, char *port_str,
-                     kv_rdma_connect_cb connect_cb, void *connect_arg,
-                     kv_rdma_disconnect_cb disconnect_cb,
-                     void *disconnect_arg) {
-  struct kv_rdma *self = h;
-  struct rdma_connection *conn = kv_malloc(sizeof(struct rdma_connection));
-  *conn = (struct rdma_connection){self, NULL, NULL, false};
-  conn->u.c.connect = connect_cb;
-  conn->u.c.connect_arg = connect_arg;
-  conn->u.c.disconnect = disconnect_cb;
-  conn->u.c.disconnect_arg = disconnect_arg;
-  conn->u.c.mp = kv_mempool_create(8191, sizeof(struct client_req_ctx));
-  struct addrinfo *addr;
-  TEST_NZ(getaddrinfo(addr_str, port_str, NULL, &addr));
-  TEST_NZ(rdma_create_id(self->ec, &conn->cm_id, NULL, RDMA_PS_TCP));
-  conn->cm_id->context = conn;
-  TEST_NZ(rdma_resolve_addr(conn->cm_id, NULL, addr->ai_addr, TIMEOUT_IN_MS));
-  freeaddrinfo(addr);
+// --- rendezvous ---
+static void on_rndv_read_done(void *_ctx, bool success) {
+  struct server_req_ctx *ctx = _ctx;
+  if (!success)
+    ctx->rndv_failed = true;
+  if (--ctx->rndv_reads)
+    return;
+  if (ctx->rndv_failed) {
+    fprintf(stderr, "on_rndv_read_done: fail to read the request.\n");
+    on_write_resp_done(ctx, false);
+    return;
+  }
+  dispatch_req(ctx, ctx->conn->u.s.handler, ctx->conn->u.s.arg, ctx->rndv_len);
 }
 
-void kv_rdma_send_req(connection_handle h, kv_rdma_mr req, uint32_t req_sz,
-                      kv_rdma_mr resp, void *resp_addr, kv_rdma_req_cb cb,
-                      void *cb_arg) {
-  struct rdma_connection *conn = h;
-  assert(conn->is_server == false);
-  struct client_req_ctx *ctx = kv_mempool_get(conn->u.c.mp);
-  *ctx = (struct client_req_ctx){conn, cb, cb_arg, req, resp};
-  assert(req_sz <= ctx->req->length);
-  if (resp_addr == NULL)
-    resp_addr = ctx->resp->addr;
-  *(struct req_header *)ctx->req->addr = (struct req_header){
-      (uint64_t)resp_addr, (uint32_t)kv_mempool_get_id(conn->u.c.mp, ctx)};
-  struct ibv_recv_wr r_wr = {(uintptr_t)conn, NULL, NULL, 0}, *r_bad_wr = NULL;
-  if (ibv_post_recv(conn->qp, &r_wr, &r_bad_wr)) {
-    goto fail;
-  }
-  struct ibv_sge sge = {(uintptr_t)ctx->req->addr, req_sz + HEADER_SIZE,
-                        ctx->req->lkey};
-  struct ibv_send_wr s_wr, *s_bad_wr = NULL;
-  memset(&s_wr, 0, sizeof(s_wr));
-  s_wr.wr_id = (uintptr_t)ctx;
-  s_wr.opcode = IBV_WR_SEND_WITH_IMM;
-  s_wr.imm_data = ctx->resp->rkey;
-  s_wr.sg_list = &sge;
-  s_wr.num_sge = 1;
-  s_wr.send_flags = IBV_SEND_SIGNALED;
-  if (ibv_post_send(conn->qp, &s_wr, &s_bad_wr)) {
-    goto fail;
-  }
-  return;
-fail:
-  if (ctx->cb)
-    ctx->cb(h, false, req, resp, ctx->cb_arg);
-  kv_free(ctx);
+// pull the payload described by the request's rndv_desc into mr.
+static void rndv_read(struct server_req_ctx *ctx, struct ibv_mr *mr) {
+  struct rndv_desc *desc =
+      (struct rndv_desc *)((uint8_t *)ctx->mr->addr + HEADER_SIZE);
+  struct ibv_sge sges[KV_RDMA_MAX_SGE];
+  struct ibv_send_wr wrs[KV_RDMA_MAX_SGE];
+  uint8_t *buf = (uint8_t *)mr->addr + HEADER_SIZE;
+  uint32_t n = desc->sge_num;
+  ctx->req_mr = mr;
+  ctx->rndv_len = desc->len;
+  ctx->rndv_reads = n;
+  ctx->rndv_failed = false;
+  if (n == 0) {
+    ctx->rndv_reads = 1;
+    on_rndv_read_done(ctx, true);
+    return;
+  }
+  for (uint32_t i = 0; i < n; i++) {
+    sges[i] = (struct ibv_sge){(uintptr_t)buf, desc->sges[i].length,
+                               mr_lkey(mr, ctx->dev)};
+    buf += desc->sges[i].length;
+    memset(wrs + i, 0, sizeof(struct ibv_send_wr));
+    wrs[i].wr_id = (uintptr_t)ctx;
+    wrs[i].next = wrs + i + 1;
+    wrs[i].opcode = IBV_WR_RDMA_READ;
+    wrs[i].sg_list = sges + i;
+    wrs[i].num_sge = 1;
+    wrs[i].wr.rdma.remote_addr = desc->sges[i].addr;
+    wrs[i].wr.rdma.rkey = desc->sges[i].rkey;
+  }
+  // the handler waits for the last read, don't let it sit unsignaled.
+  wrs[n - 1].send_flags = IBV_SEND_SIGNALED;
+  uint32_t posted = sq_post(ctx->conn, wrs, n, on_rndv_read_done);
+  if (posted < n) {
+    ctx->rndv_failed = true;
+    ctx->rndv_reads -= n - posted - 1;
+    on_rndv_read_done(ctx, false);
+  }
 }
 
-void kv_rdma_disconnect(connection_handle h) {
-  struct rdma_connection *conn = h;
-  TEST_NZ(rdma_disconnect(conn->cm_id));
+static void rndv_read_msg(void *_ctx) {
+  struct server_req_ctx *ctx = _ctx;
+  rndv_read(ctx, ctx->req_mr);
 }
 
-// --- server ---
-void kv_rdma_listen(kv_rdma_handle h, char *addr_str, char *port_str,
-                    uint32_t con_req_num, uint32_t max_msg_sz,
-                    kv_rdma_req_handler handler, void *arg,
-                    kv_rdma_server_init_cb cb, void *cb_arg) {
-  struct kv_rdma *self = h;
-  self->has_server = true;
-  self->init_cb = cb;
-  self->init_cb_arg = cb_arg;
-  struct rdma_connection *conn = kv_malloc(sizeof(struct rdma_connection));
-  *conn = (struct rdma_connection){self, NULL, NULL, true};
-  conn->u.s.handler = handler;
-  conn->u.s.arg = arg;
-  struct addrinfo *addr;
-  TEST_NZ(getaddrinfo(addr_str, port_str, NULL, &addr));
-  TEST_NZ(rdma_create_id(self->ec, &conn->cm_id, NULL, RDMA_PS_TCP));
-  TEST_NZ(rdma_bind_addr(conn->cm_id, addr->ai_addr));
-  TEST_NZ(rdma_listen(conn->cm_id, 10));
-  /* backlog=10 is arbitrary  TODO:conn_num*/
-  conn->cm_id->context = conn;
-  freeaddrinfo(addr);
-  self->con_req_num = con_req_num;
-  self->max_msg_sz = max_msg_sz;
-  pthread_rwlock_init(&self->lock, NULL);
-  printf("kv rdma listening on %s %s.\n", addr_str, port_str);
+static void rndv_release(struct kv_rdma *self, struct ibv_mr *mr) {
+  struct server_req_ctx *ctx;
+  pthread_spin_lock(&self->rndv_lock);
+  if ((ctx = STAILQ_FIRST(&self->rndv_pending)))
+    STAILQ_REMOVE_HEAD(&self->rndv_pending, next);
+  else
+    self->rndv_free[self->rndv_free_num++] = mr;
+  pthread_spin_unlock(&self->rndv_lock);
+  if (ctx) {
+    // the reads complete on the owner of the connection, start them there.
+    ctx->req_mr = mr;
+    kv_app_send(self->thread_id + ctx->conn->thread, rndv_read_msg, ctx);
+  }
 }
 
-void kv_rdma_make_resp(void *req_h, uint8_t *resp, uint32_t resp_sz) {
-  struct server_req_ctx *ctx = req_h;
-  struct ibv_sge sge = {(uintptr_t)resp, resp_sz, ctx->mr->lkey};
-  struct ibv_send_wr wr, *bad_wr = NULL;
-  wr.wr_id = (uintptr_t)ctx;
-  wr.next = NULL;
-  wr.opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
-  wr.imm_data = ctx->header.req_id;
-  wr.sg_list = &sge;
-  wr.num_sge = 1;
-  wr.send_flags = IBV_SEND_SIGNALED;
-  wr.wr.rdma.remote_addr = ctx->header.resp_addr;
-  wr.wr.rdma.rkey = ctx->resp_rkey;
-  TEST_NZ(ibv_post_send(ctx->conn->qp, &wr, &bad_wr));
+static struct ibv_mr *rndv_get(struct kv_rdma *self) {
+  struct ibv_mr *mr = NULL;
+  pthread_spin_lock(&self->rndv_lock);
+  if (self->rndv_free_num)
+    mr = self->rndv_free[--self->rndv_free_num];
+  pthread_spin_unlock(&self->rndv_lock);
+  return mr;
 }
 
-uint32_t kv_rdma_conn_num(kv_rdma_handle h) {
-  struct kv_rdma *self = h;
-  uint32_t num;
-  pthread_rwlock_rdlock(&self->lock);
-  num = HASH_CNT(u.s.hh, self->connections);
-  pthread_rwlock_unlock(&self->lock);
-  return num;
+static void rndv_start(struct server_req_ctx *ctx, uint32_t desc_len) {
+  struct kv_rdma *self = ctx->self;
+  struct rndv_desc *desc =
+      (struct rndv_desc *)((uint8_t *)ctx->mr->addr + HEADER_SIZE);
+  uint64_t len = 0;
+  if (desc_len >= RNDV_DESC_SIZE(0) && desc->sge_num <= KV_RDMA_MAX_SGE &&
+      desc_len >= RNDV_DESC_SIZE(desc->sge_num))
+    for (uint32_t i = 0; i < desc->sge_num; i++)
+      len += desc->sges[i].length;
+  if (self->rndv_mrs == NULL || desc_len < RNDV_DESC_SIZE(0) ||
+      len != desc->len || len > self->rndv_buf_sz) {
+    fprintf(stderr, "rndv_start: invalid rendezvous request.\n");
+    on_write_resp_done(ctx, false);
+    return;
+  }
+  struct ibv_mr *mr = NULL;
+  pthread_spin_lock(&self->rndv_lock);
+  if (self->rndv_free_num)
+    mr = self->rndv_free[--self->rndv_free_num];
+  else
+    STAILQ_INSERT_TAIL(&self->rndv_pending, ctx, next);
+  pthread_spin_unlock(&self->rndv_lock);
+  if (mr)
+    rndv_read(ctx, mr);
 }
 
-// --- cq_poller ---
-static inline void on_write_resp_done(struct ibv_wc *wc) {
-  if (wc->status != IBV_WC_SUCCESS) {
-    fprintf(stderr, "on_write_resp_done: status is %d\n", wc->status);
+uint8_t *kv_rdma_alloc_large_resp(void *req_h, uint32_t size) {
+  struct server_req_ctx *ctx = req_h;
+  // a ud response has to fit a datagram.
+  if (ctx->ud || size > ctx->self->rndv_buf_sz)
+    return NULL;
+  if (ctx->req_mr == ctx->mr && (ctx->req_mr = rndv_get(ctx->self)) == NULL) {
+    ctx->req_mr = ctx->mr;
+    return NULL;
   }
-  struct server_req_ctx *ctx = (struct server_req_ctx *)wc->wr_id;
-  assert(ctx->conn->is_server);
-  struct ibv_sge sge = {(uint64_t)ctx->mr->addr, ctx->mr->length,
-                        ctx->mr->lkey};
-  struct ibv_recv_wr wr = {(uint64_t)ctx, NULL, &sge, 1}, *bad_wr = NULL;
-  TEST_NZ(ibv_post_srq_recv(ctx->self->srq, &wr, &bad_wr));
+  return (uint8_t *)ctx->req_mr->addr + HEADER_SIZE;
 }
 
 static inline void on_recv_req(struct ibv_wc *wc) {
   if (wc->status != IBV_WC_SUCCESS) {
     fprintf(stderr, "on_recv_req: status is %d\n", wc->status);
-    wc->status = IBV_WC_SUCCESS;
-    on_write_resp_done(wc);
+    on_write_resp_done((struct server_req_ctx *)wc->wr_id, true);
     return;
   }
   struct server_req_ctx *ctx = (struct server_req_ctx *)wc->wr_id;
-  assert(wc->byte_len > HEADER_SIZE);
-  assert(wc->wc_flags & IBV_WC_WITH_IMM);
-  pthread_rwlock_rdlock(&ctx->self->lock);
-  HASH_FIND(u.s.hh, ctx->self->connections, &wc->qp_num, sizeof(uint32_t),
-            ctx->conn);
-  pthread_rwlock_unlock(&ctx->self->lock);
-  assert(ctx->conn);
+  ctx->resp_cb = NULL;
+  if (wc->byte_len < HEADER_SIZE || !(wc->wc_flags & IBV_WC_WITH_IMM)) {
+    fprintf(stderr, "on_recv_req: malformed request of %u bytes\n",
+            wc->byte_len);
+    on_write_resp_done(ctx, true);
+    return;
+  }
+  ctx->header = *(struct req_header *)ctx->mr->addr;
+  // a plain load is enough here: the slot is published before the qp can
+  // receive anything and a stale or forged slot fails the qp_num check.
+  ctx->conn = ctx->header.conn_slot < MAX_CONN_NUM
+                  ? ctx->self->conns[ctx->header.conn_slot]
+                  : NULL;
+  if (ctx->conn == NULL || ctx->conn->qp_num != wc->qp_num ||
+      ctx->conn->dev != ctx->dev) {
+    fprintf(stderr, "on_recv_req: unknown connection slot %u\n",
+            ctx->header.conn_slot);
+    on_write_resp_done(ctx, true);
+    return;
+  }
   assert(ctx->conn->is_server);
+  // the requests still completing on a connection being torn down are
+  // dropped.
+  if (!conn_get(ctx->conn))
+    ctx->conn = NULL;
+  ctx->conn_ref = ctx->conn != NULL;
+  if (ctx->conn == NULL ||
+      __atomic_load_n(&ctx->conn->closing, __ATOMIC_ACQUIRE)) {
+    on_write_resp_done(ctx, true);
+    return;
+  }
+  if (ctx->header.flags & REQ_STREAM_ACK) {
+    stream_recv_ack(ctx);
+    return;
+  }
+  if (ctx->header.flags & REQ_ONEWAY) {
+    if (ctx->self->msg_handler == NULL || (ctx->header.flags & REQ_RNDV)) {
+      fprintf(stderr, "on_recv_req: unexpected one-way message.\n");
+      ctx->worker = NO_WORKER;
+      msg_done(ctx);
+      return;
+    }
+    dispatch_req(ctx, ctx->self->msg_handler, ctx->self->msg_arg,
+                 wc->byte_len - HEADER_SIZE);
+    return;
+  }
+  // the receive buffer is reposted once the request is done with.
+  __atomic_add_fetch(&ctx->conn->u.s.owed, 1, __ATOMIC_RELAXED);
   ctx->resp_rkey = wc->imm_data;
-  ctx->header = *(struct req_header *)ctx->mr->addr;
-  ctx->conn->u.s.handler(ctx, ctx->mr, wc->byte_len - HEADER_SIZE,
-                         ctx->conn->u.s.arg);
+  if (ctx->header.flags & REQ_DIRECTORY) {
+    dir_serve(ctx, wc->byte_len - HEADER_SIZE);
+    return;
+  }
+  if (ctx->header.flags & REQ_STREAM) {
+    stream_start(ctx, wc->byte_len - HEADER_SIZE);
+    return;
+  }
+  if (ctx->header.flags & REQ_RNDV) {
+    rndv_start(ctx, wc->byte_len - HEADER_SIZE);
+    return;
+  }
+  dispatch_req(ctx, ctx->conn->u.s.handler, ctx->conn->u.s.arg,
+               wc->byte_len - HEADER_SIZE);
 }
 
 static inline void on_recv_resp(struct ibv_wc *wc) {
-  struct rdma_connection *conn = (struct rdma_connection *)wc->wr_id;
+  struct rdma_connection *conn =
+      (struct rdma_connection *)(wc->wr_id & ~(uint64_t)WR_KIND);
   assert(!conn->is_server);
   assert(wc->wc_flags & IBV_WC_WITH_IMM);
+  if (++conn->u.c.recv_used == RECV_BATCH) {
+    recv_post(conn, RECV_BATCH);
+    conn->u.c.recv_used = 0;
+  }
   // using wc->imm_data(req_id) to find corresponding request_ctx
+  uint32_t id = IMM_ID(wc->imm_data);
   struct client_req_ctx *ctx =
-      kv_mempool_get_ele(conn->u.c.mp, (int32_t)wc->imm_data);
-  ctx->cb(ctx->conn, wc->status == IBV_WC_SUCCESS, ctx->req, ctx->resp,
-          ctx->cb_arg);
-  kv_mempool_put(conn->u.c.mp, ctx);
+      id == IMM_CREDIT_ONLY
+          ? NULL
+          : kv_mempool_get_ele(conn->u.c.mp,
+                               (int64_t)REQ_INDEX(id) * conn->u.c.ctx_sz);
+  // without flow control, each response gives back the credit of its own
+  // request, and a stream its last chunk.
+  bool chunk = wc->imm_data & IMM_STREAM;
+  uint32_t credits = conn->u.c.peer.credits ? IMM_CREDITS(wc->imm_data)
+                     : chunk                 ? !!(wc->imm_data & IMM_LAST)
+                                             : 1;
+  if (credits) {
+    pthread_spin_lock(&conn->u.c.lock);
+    conn->u.c.credits += credits;
+    pthread_spin_unlock(&conn->u.c.lock);
+  }
+  if (ctx == NULL) {
+    // the credits of one-way messages.
+  } else if (REQ_GEN(id) != (ctx->gen & REQ_GEN_MASK)) {
+    // the request has timed out already.
+    STATS(conn->self)->stale_resps++;
+  } else if (chunk) {
+    on_recv_chunk(conn, ctx, wc);
+  } else {
+    if (kv_timer_pending(&ctx->timer)) {
+      struct cq_poller_ctx *poller = conn->dev->cq_pollers + conn->thread;
+      pthread_spin_lock(&poller->timer_lock);
+      kv_timer_del(&poller->wheel, &ctx->timer);
+      pthread_spin_unlock(&poller->timer_lock);
+    }
+    ctx->cb(ctx->conn, wc->status == IBV_WC_SUCCESS, ctx->req, ctx->resp,
+            ctx->cb_arg);
+    if (ctx->auto_resp)
+      slab_free((struct slab_buf *)ctx->resp);
+    req_put(conn, ctx);
+  }
+  if (!STAILQ_EMPTY(&conn->u.c.acks))
+    flush_acks(conn);
+  if (!STAILQ_EMPTY(&conn->u.c.pending))
+    flush_reqs(conn);
+}
+
+static void expire_reqs(struct cq_poller_ctx *ctx) {
+  struct kv_timer_list expired;
+  struct kv_timer *timer;
+  LIST_INIT(&expired);
+  pthread_spin_lock(&ctx->timer_lock);
+  kv_timer_advance(&ctx->wheel, now_ms(), &expired);
+  pthread_spin_unlock(&ctx->timer_lock);
+  while ((timer = kv_timer_pop(&expired))) {
+    struct client_req_ctx *req = (struct client_req_ctx *)(
+        (uint8_t *)timer - offsetof(struct client_req_ctx, timer));
+    req_expire(req->conn, req);
+  }
+}
+
+// --- ud transport ---
+// small rpcs may also go over unreliable datagrams: a server then has one ud
+// qp per cq poller for all its clients instead of one rc qp per client. a
+// client session is set up through the cm and has UD_SLOTS request slots.
+// each use of a slot bumps its sequence number, and the server runs a request
+// once per (slot, seq) and keeps the response in the slot to resend it if the
+// request is retransmitted. a client retransmits a request still without
+// response after ud_rto_us, and fails it after ud_retries retransmissions. it
+// allows one more request in flight per window of responses, up to UD_SLOTS,
+// and halves its window on each retransmission.
+#define UD_GRH (40U) // prepended to each received datagram
+#define UD_SLOTS (8U)
+// tags in the low bits of the wr_id of ud receives.
+#define UD_WR_SERVER (1U)
+#define UD_WR_CLIENT (2U)
+#define UD_WR_TAG (3U)
+enum { UD_REQ, UD_RESP, UD_RESP_ERR, UD_BYE };
+enum { UD_SLOT_FREE, UD_SLOT_BUSY, UD_SLOT_DONE };
+// as large as a req_header, so kv_rdma_get_req_buf works on datagrams too.
+struct ud_header {
+  uint32_t session;
+  uint32_t seq;
+  uint32_t slot;
+  uint32_t type;
+} __attribute__((packed));
+// sent by the server along with rdma_accept.
+struct ud_private_data {
+  uint32_t session;
+  uint32_t msg_sz; // largest datagram, header included
+} __attribute__((packed));
+
+struct ud_endpoint {
+  struct rdma_connection conn; // the ud qp and its send queue
+  struct mr_bulk *bufs;
+  struct rdma_mr *mrs; // handles of the datagrams, past the grh
+  struct server_req_ctx *requests;
+  uint32_t num;
+};
+// a session is referenced by the session table, by each request being handled
+// and by each response being sent.
+struct ud_session {
+  struct rdma_device *dev;
+  struct ud_endpoint *ep;
+  uint32_t id;
+  kv_rdma_req_handler handler;
+  void *arg;
+  struct ibv_ah *ah; // made from the first datagram of the client
+  uint32_t qpn;
+  struct ibv_mr *resps; // a response of ud_msg_sz bytes per slot
+  struct {
+    uint32_t seq, len;
+    uint8_t state; // updated atomically, responses may be made on any thread
+  } slots[UD_SLOTS];
+  uint32_t refs;
+};
+struct ud_recv {
+  struct rdma_connection *conn;
+  uint8_t *buf;
+};
+struct ud_client {
+  struct ibv_ah *ah;
+  uint32_t qpn, qkey, session, msg_sz;
+  // under the lock of the connection.
+  uint32_t cwnd, acked, inflight;
+  struct {
+    struct client_req_ctx *ctx; // NULL if the slot is free
+    uint32_t seq, retries;
+    uint64_t sent_us;
+  } slots[UD_SLOTS];
+  struct mr_bulk *bufs;
+  struct ud_recv recvs[UD_RECV_NUM];
+  void *poller; // retransmits on the thread of the connection
+};
+
+static void ud_server_repost(struct server_req_ctx *ctx) {
+  struct ibv_mr *mr = ctx->mr;
+  struct ibv_sge sge = {(uintptr_t)mr->addr - UD_GRH, UD_GRH + mr->length,
+                        mr_lkey(mr, ctx->dev)};
+  struct ibv_recv_wr wr = {(uintptr_t)ctx | UD_WR_SERVER, NULL, &sge, 1},
+                     *bad_wr = NULL;
+  if (ibv_post_recv(ctx->conn->qp, &wr, &bad_wr))
+    fprintf(stderr, "kv_rdma: fail to post a ud receive.\n");
+}
+
+static void ud_endpoint_create(struct cq_poller_ctx *poller) {
+  struct rdma_device *dev = poller->dev;
+  struct kv_rdma *self = dev->self;
+  struct ud_endpoint *ep = kv_calloc(1, sizeof(struct ud_endpoint));
+  struct rdma_connection *conn = &ep->conn;
+  *conn = (struct rdma_connection){self, NULL, NULL, 0, true, dev};
+  conn->thread = poller - dev->cq_pollers;
+  struct ibv_qp_init_attr qp_attr;
+  memset(&qp_attr, 0, sizeof(qp_attr));
+  qp_attr.send_cq = poller->cq;
+  qp_attr.recv_cq = poller->cq;
+  qp_attr.qp_type = IBV_QPT_UD;
+  qp_attr.cap.max_send_wr = MAX_Q_NUM;
+  qp_attr.cap.max_recv_wr = self->ud_recv_num;
+  qp_attr.cap.max_send_sge = 1;
+  qp_attr.cap.max_recv_sge = 1;
+  qp_attr.cap.max_inline_data = self->inline_threshold;
+  if ((conn->qp = ibv_create_qp(dev->pd, &qp_attr)) == NULL) {
+    qp_attr.cap.max_inline_data = 0;
+    TEST_Z(conn->qp = ibv_create_qp(dev->pd, &qp_attr));
+  }
+  // the qkey is the one the cm gives to ud clients.
+  struct ibv_qp_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.qp_state = IBV_QPS_INIT;
+  attr.port_num = dev->ud_port;
+  attr.qkey = RDMA_UDP_QKEY;
+  TEST_NZ(ibv_modify_qp(conn->qp, &attr,
+                        IBV_QP_STATE | IBV_QP_PKEY_INDEX | IBV_QP_PORT |
+                            IBV_QP_QKEY));
+  attr.qp_state = IBV_QPS_RTR;
+  TEST_NZ(ibv_modify_qp(conn->qp, &attr, IBV_QP_STATE));
+  attr.qp_state = IBV_QPS_RTS;
+  attr.sq_psn = 0;
+  TEST_NZ(ibv_modify_qp(conn->qp, &attr, IBV_QP_STATE | IBV_QP_SQ_PSN));
+  conn->qp_num = conn->qp->qp_num;
+  conn->max_sge = 1;
+  conn->max_inline = qp_attr.cap.max_inline_data < self->inline_threshold
+                         ? qp_attr.cap.max_inline_data
+                         : self->inline_threshold;
+  sq_init(&conn->sq);
+  size_t buf_sz = UD_GRH + dev->ud_msg_sz;
+  ep->num = self->ud_recv_num;
+  TEST_Z(ep->bufs =
+             kv_rdma_alloc_bulk(self, KV_RDMA_MR_RESP, buf_sz, ep->num));
+  ep->mrs = kv_calloc(ep->num, sizeof(struct rdma_mr));
+  ep->requests = kv_calloc(ep->num, sizeof(struct server_req_ctx));
+  for (uint32_t i = 0; i < ep->num; i++) {
+    struct server_req_ctx *ctx = ep->requests + i;
+    mr_narrow(ep->mrs + i, ep->bufs->regs, ep->bufs->buf + i * buf_sz + UD_GRH,
+              dev->ud_msg_sz);
+    ctx->conn = conn;
+    ctx->self = self;
+    ctx->dev = dev;
+    ctx->mr = &ep->mrs[i].mr;
+    ctx->req_mr = ctx->mr;
+    ud_server_repost(ctx);
+  }
+  poller->ud = ep;
 }
 
-static inline void on_send_req(struct ibv_wc *wc) {
+// the ud qps of a device are bound to the port of its first ud client.
+static void ud_device_start(struct rdma_device *dev, uint8_t port) {
+  struct ibv_port_attr attr;
+  TEST_NZ(ibv_query_port(dev->ctx, port, &attr));
+  dev->ud_port = port;
+  dev->ud_msg_sz = 128U << attr.active_mtu;
+  for (uint32_t i = 0; i < dev->self->thread_num; i++)
+    ud_endpoint_create(dev->cq_pollers + i);
+}
+
+static void ud_session_put(struct ud_session *session) {
+  if (__atomic_sub_fetch(&session->refs, 1, __ATOMIC_ACQ_REL))
+    return;
+  if (session->ah)
+    ibv_destroy_ah(session->ah);
+  slab_free((struct slab_buf *)session->resps);
+  kv_free(session);
+}
+
+static void ud_session_close(struct ud_session *session) {
+  struct kv_rdma *self = session->dev->self;
+  __atomic_store_n(self->ud_sessions + session->id, NULL, __ATOMIC_RELEASE);
+  ud_session_put(session);
+}
+
+static int ud_accept(struct kv_rdma *self, struct rdma_cm_id *cm_id) {
+  struct rdma_connection *lconn = cm_id->context;
+  struct rdma_device *dev = device_of(self, cm_id->verbs);
+  uint32_t id = 0;
+  while (id < MAX_CONN_NUM && self->ud_sessions[id])
+    id++;
+  if (dev == NULL || id == MAX_CONN_NUM) {
+    fprintf(stderr, "kv_rdma: fail to accept a ud session.\n");
+    rdma_reject(cm_id, NULL, 0);
+    rdma_destroy_id(cm_id);
+    return 0;
+  }
+  if (dev->cq_pollers == NULL)
+    device_start(dev);
+  if (dev->ud_msg_sz == 0)
+    ud_device_start(dev, cm_id->port_num);
+  struct ud_session *session = kv_calloc(1, sizeof(struct ud_session));
+  session->dev = dev;
+  session->ep = dev->cq_pollers[self->next_thread++ % self->thread_num].ud;
+  session->id = id;
+  session->handler = lconn->u.s.handler;
+  session->arg = lconn->u.s.arg;
+  session->refs = 1;
+  TEST_Z(session->resps = slab_alloc(self, UD_SLOTS * dev->ud_msg_sz,
+                                     IBV_ACCESS_LOCAL_WRITE));
+  __atomic_store_n(self->ud_sessions + id, session, __ATOMIC_RELEASE);
+  struct ud_private_data data = {id, dev->ud_msg_sz};
+  struct rdma_conn_param cm_params;
+  memset(&cm_params, 0, sizeof(cm_params));
+  cm_params.private_data = &data;
+  cm_params.private_data_len = sizeof(data);
+  cm_params.qp_num = session->ep->conn.qp_num;
+  TEST_NZ(rdma_accept(cm_id, &cm_params));
+  // a ud session keeps no state in the cm.
+  rdma_destroy_id(cm_id);
+  return 0;
+}
+
+static void on_ud_resp_done(void *ctx, bool success) {
+  if (!success)
+    fprintf(stderr, "on_ud_resp_done: send failed.\n");
+  ud_session_put(ctx);
+}
+
+static void ud_send_resp(struct ud_session *session, uint32_t slot) {
+  struct ud_endpoint *ep = session->ep;
+  struct ibv_mr *mr = session->resps;
+  uint32_t len = session->slots[slot].len;
+  struct ibv_sge sge = {(uintptr_t)mr->addr + slot * session->dev->ud_msg_sz,
+                        len, mr_lkey(mr, session->dev)};
+  struct ibv_send_wr wr;
+  memset(&wr, 0, sizeof(wr));
+  wr.wr_id = (uintptr_t)session;
+  wr.opcode = IBV_WR_SEND;
+  wr.sg_list = &sge;
+  wr.num_sge = 1;
+  wr.wr.ud.ah = session->ah;
+  wr.wr.ud.remote_qpn = session->qpn;
+  wr.wr.ud.remote_qkey = RDMA_UDP_QKEY;
+  if (len <= ep->conn.max_inline)
+    wr.send_flags = IBV_SEND_INLINE;
+  // a closed session is freed once its last response is reclaimed, which a
+  // ud qp can't force later on like sq_flush_idle does.
+  struct ud_session **entry = session->dev->self->ud_sessions + session->id;
+  if (__atomic_load_n(entry, __ATOMIC_ACQUIRE) != session)
+    wr.send_flags |= IBV_SEND_SIGNALED;
+  __atomic_add_fetch(&session->refs, 1, __ATOMIC_RELAXED);
+  if (sq_post(&ep->conn, &wr, 1, on_ud_resp_done) != 1) {
+    fprintf(stderr, "kv_rdma_make_resp: fail to post response.\n");
+    ud_session_put(session);
+  }
+}
+
+// copy the response into the slot of the request, which keeps it for the
+// retransmissions, and give the datagram back to the qp. without sges the
+// request fails.
+static void ud_make_resp(struct server_req_ctx *ctx, struct ibv_sge *sges,
+                         uint32_t sge_num) {
+  struct ud_session *session = ctx->ud;
+  uint32_t slot = ctx->ud_slot, len = 0, msg_sz = session->dev->ud_msg_sz;
+  uint8_t *buf = (uint8_t *)session->resps->addr + slot * msg_sz;
+  uint32_t type = UD_RESP;
+  for (uint32_t i = 0; i < sge_num; i++)
+    len += sges[i].length;
+  if (sges == NULL || HEADER_SIZE + len > msg_sz) {
+    if (sges)
+      fprintf(stderr, "kv_rdma_make_resp: response too large for ud.\n");
+    type = UD_RESP_ERR;
+    len = 0;
+  }
+  uint8_t *data = buf + HEADER_SIZE;
+  for (uint32_t i = 0; type == UD_RESP && i < sge_num; i++) {
+    kv_memcpy(data, (void *)(uintptr_t)sges[i].addr, sges[i].length);
+    data += sges[i].length;
+  }
+  *(struct ud_header *)buf =
+      (struct ud_header){session->id, session->slots[slot].seq, slot, type};
+  session->slots[slot].len = HEADER_SIZE + len;
+  __atomic_store_n(&session->slots[slot].state, UD_SLOT_DONE,
+                   __ATOMIC_RELEASE);
+  STATS(ctx->self)->resps++;
+  ud_send_resp(session, slot);
+  ctx->ud = NULL;
+  ud_server_repost(ctx);
+  ud_session_put(session);
+}
+
+static void on_recv_ud_req(struct ibv_wc *wc) {
+  struct server_req_ctx *ctx =
+      (struct server_req_ctx *)(wc->wr_id & ~(uint64_t)UD_WR_TAG);
+  struct kv_rdma *self = ctx->self;
+  if (wc->status != IBV_WC_SUCCESS) {
+    // flushed when the qp is destroyed.
+    if (wc->status != IBV_WC_WR_FLUSH_ERR) {
+      fprintf(stderr, "on_recv_ud_req: status is %d\n", wc->status);
+      ud_server_repost(ctx);
+    }
+    return;
+  }
+  struct ud_header *header = ctx->mr->addr;
+  struct ud_session *session =
+      header->session < MAX_CONN_NUM
+          ? __atomic_load_n(self->ud_sessions + header->session,
+                            __ATOMIC_ACQUIRE)
+          : NULL;
+  if (wc->byte_len < UD_GRH + HEADER_SIZE || session == NULL ||
+      &session->ep->conn != ctx->conn || header->slot >= UD_SLOTS ||
+      (session->ah && session->qpn != wc->src_qp)) {
+    ud_server_repost(ctx);
+    return;
+  }
+  if (session->ah == NULL) {
+    struct ibv_grh *grh = (struct ibv_grh *)((uint8_t *)header - UD_GRH);
+    session->ah = ibv_create_ah_from_wc(session->dev->pd, wc, grh,
+                                        session->dev->ud_port);
+    if (session->ah == NULL) {
+      fprintf(stderr, "on_recv_ud_req: fail to create an address handle.\n");
+      ud_server_repost(ctx);
+      return;
+    }
+    session->qpn = wc->src_qp;
+  }
+  if (header->type == UD_BYE) {
+    ud_session_close(session);
+    ud_server_repost(ctx);
+    return;
+  }
+  uint32_t slot = header->slot;
+  uint8_t state =
+      __atomic_load_n(&session->slots[slot].state, __ATOMIC_ACQUIRE);
+  if (state != UD_SLOT_FREE &&
+      (int32_t)(header->seq - session->slots[slot].seq) <= 0) {
+    // a retransmission, its response is sent again once made.
+    if (header->seq == session->slots[slot].seq && state == UD_SLOT_DONE)
+      ud_send_resp(session, slot);
+    ud_server_repost(ctx);
+    return;
+  }
+  session->slots[slot].seq = header->seq;
+  session->slots[slot].state = UD_SLOT_BUSY;
+  __atomic_add_fetch(&session->refs, 1, __ATOMIC_RELAXED);
+  ctx->ud = session;
+  ctx->ud_slot = slot;
+  ctx->resp_cb = NULL;
+  dispatch_req(ctx, session->handler, session->arg,
+               wc->byte_len - UD_GRH - HEADER_SIZE);
+}
+
+// --- ud client ---
+static void ud_client_repost(struct rdma_connection *conn,
+                             struct ud_recv *recv) {
+  struct ud_client *ud = conn->u.c.ud;
+  struct ibv_sge sge = {(uintptr_t)recv->buf, UD_GRH + ud->msg_sz,
+                        ud->bufs->regs[conn->dev->index]->lkey};
+  struct ibv_recv_wr wr = {(uintptr_t)recv | UD_WR_CLIENT, NULL, &sge, 1},
+                     *bad_wr = NULL;
+  if (ibv_post_recv(conn->qp, &wr, &bad_wr))
+    fprintf(stderr, "kv_rdma: fail to post a ud receive.\n");
+}
+
+static void ud_client_init(struct rdma_connection *conn) {
+  struct ud_client *ud = kv_calloc(1, sizeof(struct ud_client));
+  struct ibv_port_attr attr;
+  TEST_NZ(ibv_query_port(conn->dev->ctx, conn->cm_id->port_num, &attr));
+  ud->msg_sz = 128U << attr.active_mtu;
+  ud->cwnd = UD_SLOTS;
+  size_t buf_sz = UD_GRH + ud->msg_sz;
+  TEST_Z(ud->bufs = kv_rdma_alloc_bulk(conn->self, KV_RDMA_MR_RESP, buf_sz,
+                                       UD_RECV_NUM));
+  conn->u.c.ud = ud;
+  for (uint32_t i = 0; i < UD_RECV_NUM; i++) {
+    ud->recvs[i] = (struct ud_recv){conn, ud->bufs->buf + i * buf_sz};
+    ud_client_repost(conn, ud->recvs + i);
+  }
+}
+
+// fill the send of the request in slot, called with the lock held.
+static void ud_prepare(struct rdma_connection *conn, uint32_t slot,
+                       struct ibv_send_wr *wr) {
+  struct ud_client *ud = conn->u.c.ud;
+  struct client_req_ctx *ctx = ud->slots[slot].ctx;
+  *(struct ud_header *)ctx->req->addr =
+      (struct ud_header){ud->session, ud->slots[slot].seq, slot, UD_REQ};
+  memset(wr, 0, sizeof(struct ibv_send_wr));
+  wr->wr_id = (uintptr_t)ctx;
+  wr->next = wr + 1;
+  wr->opcode = IBV_WR_SEND;
+  wr->sg_list = ctx->sges;
+  wr->num_sge = ctx->sge_num;
+  wr->wr.ud.ah = ud->ah;
+  wr->wr.ud.remote_qpn = ud->qpn;
+  wr->wr.ud.remote_qkey = ud->qkey;
+  if (ctx->len <= conn->max_inline)
+    wr->send_flags = IBV_SEND_INLINE;
+}
+
+// sends lost on a full send queue are retransmitted like lost datagrams.
+static void ud_post(struct rdma_connection *conn, struct ibv_send_wr *wrs,
+                    uint32_t n) {
+  uint32_t posted = sq_post(conn, wrs, n, on_send_req);
+  struct rdma_stats *stats = STATS(conn->self);
+  stats->reqs += posted;
+  for (uint32_t i = 0; i < posted; i++)
+    if (wrs[i].send_flags & IBV_SEND_INLINE)
+      stats->inline_reqs++;
+}
+
+// send the queued requests the window and the free slots allow.
+static void ud_flush(struct rdma_connection *conn) {
+  struct ud_client *ud = conn->u.c.ud;
+  struct ibv_send_wr wrs[UD_SLOTS];
+  uint32_t n = 0;
+  uint64_t now = now_us();
+  pthread_spin_lock(&conn->u.c.lock);
+  for (uint32_t i = 0; i < UD_SLOTS && ud->inflight < ud->cwnd; i++) {
+    if (STAILQ_EMPTY(&conn->u.c.pending))
+      break;
+    if (ud->slots[i].ctx)
+      continue;
+    ud->slots[i].ctx = STAILQ_FIRST(&conn->u.c.pending);
+    STAILQ_REMOVE_HEAD(&conn->u.c.pending, next);
+    ud->slots[i].seq++;
+    ud->slots[i].retries = 0;
+    ud->slots[i].sent_us = now;
+    ud->inflight++;
+    ud_prepare(conn, i, wrs + n++);
+  }
+  pthread_spin_unlock(&conn->u.c.lock);
+  if (n)
+    ud_post(conn, wrs, n);
+}
+
+static void ud_send_reqs(struct rdma_connection *conn,
+                         struct kv_rdma_req *reqs, uint32_t num) {
+  for (uint32_t i = 0; i < num; i++) {
+    struct client_req_ctx *ctx = kv_mempool_get(conn->u.c.mp);
+    struct ibv_mr *resp = reqs[i].resp;
+    uint32_t sge_num = 0;
+    if (ctx)
+      __atomic_add_fetch(&conn->u.c.outstanding, 1, __ATOMIC_RELAXED);
+    if (ctx && resp == NULL)
+      resp = slab_alloc(conn->self, conn->self->auto_resp_sz,
+                        IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE);
+    // a ud session carries no one-way messages.
+    if (ctx && resp && !reqs[i].oneway) {
+      uint16_t gen = ctx->gen;
+      *ctx = (struct client_req_ctx){conn, reqs[i].cb, reqs[i].cb_arg,
+                                     reqs[i].req, resp, reqs[i].resp == NULL,
+                                     false, gen};
+      ctx->resp_buf = reqs[i].resp_addr ? reqs[i].resp_addr : resp->addr;
+      // larger requests than a datagram take the rendezvous path of
+      // build_req, which a ud session does not offer.
+      sge_num = build_req(conn, reqs + i, ctx,
+                          (struct req_header *)ctx->req->addr, ctx->sges,
+                          &ctx->len);
+    }
+    if (sge_num == 0) {
+      if (ctx)
+        req_put(conn, ctx);
+      if (reqs[i].cb)
+        reqs[i].cb(conn, false, reqs[i].req, resp, reqs[i].cb_arg);
+      if (resp && reqs[i].resp == NULL)
+        slab_free((struct slab_buf *)resp);
+      continue;
+    }
+    ctx->sge_num = sge_num;
+    pthread_spin_lock(&conn->u.c.lock);
+    STAILQ_INSERT_TAIL(&conn->u.c.pending, ctx, next);
+    pthread_spin_unlock(&conn->u.c.lock);
+  }
+  ud_flush(conn);
+}
+
+static int ud_retransmit(void *arg) {
+  struct rdma_connection *conn = arg;
+  struct ud_client *ud = conn->u.c.ud;
+  struct kv_rdma *self = conn->self;
+  struct ibv_send_wr wrs[UD_SLOTS];
+  struct client_req_ctx *failed[UD_SLOTS];
+  uint32_t n = 0, f = 0;
+  uint64_t now = now_us();
+  pthread_spin_lock(&conn->u.c.lock);
+  for (uint32_t i = 0; i < UD_SLOTS; i++) {
+    if (ud->slots[i].ctx == NULL ||
+        now - ud->slots[i].sent_us < self->ud_rto_us)
+      continue;
+    if (ud->slots[i].retries++ == self->ud_retries) {
+      failed[f++] = ud->slots[i].ctx;
+      ud->slots[i].ctx = NULL;
+      ud->inflight--;
+      continue;
+    }
+    ud->slots[i].sent_us = now;
+    ud_prepare(conn, i, wrs + n++);
+  }
+  if (n || f) {
+    ud->cwnd = ud->cwnd > 1 ? ud->cwnd / 2 : 1;
+    ud->acked = 0;
+  }
+  pthread_spin_unlock(&conn->u.c.lock);
+  STATS(self)->ud_retransmits += n;
+  if (n)
+    ud_post(conn, wrs, n);
+  for (uint32_t i = 0; i < f; i++) {
+    STATS(self)->timeouts++;
+    req_fail(conn, failed[i]);
+  }
+  if (f)
+    ud_flush(conn);
+  return n + f ? 1 : 0;
+}
+
+static void on_recv_ud_resp(struct ibv_wc *wc) {
+  struct ud_recv *recv = (struct ud_recv *)(wc->wr_id & ~(uint64_t)UD_WR_TAG);
+  struct rdma_connection *conn = recv->conn;
+  struct ud_client *ud = conn->u.c.ud;
   if (wc->status != IBV_WC_SUCCESS) {
-    fprintf(stderr, "on_send_req: status is %d\n", wc->status);
+    if (wc->status != IBV_WC_WR_FLUSH_ERR) {
+      fprintf(stderr, "on_recv_ud_resp: status is %d\n", wc->status);
+      ud_client_repost(conn, recv);
+    }
+    return;
+  }
+  struct ud_header *header = (struct ud_header *)(recv->buf + UD_GRH);
+  uint32_t slot = header->slot, len = wc->byte_len - UD_GRH - HEADER_SIZE;
+  struct client_req_ctx *ctx = NULL;
+  pthread_spin_lock(&conn->u.c.lock);
+  if (wc->byte_len >= UD_GRH + HEADER_SIZE && slot < UD_SLOTS &&
+      header->session == ud->session && ud->slots[slot].ctx &&
+      ud->slots[slot].seq == header->seq) {
+    ctx = ud->slots[slot].ctx;
+    ud->slots[slot].ctx = NULL;
+    ud->inflight--;
+    if (++ud->acked >= ud->cwnd) {
+      ud->acked = 0;
+      if (ud->cwnd < UD_SLOTS)
+        ud->cwnd++;
+    }
+  }
+  pthread_spin_unlock(&conn->u.c.lock);
+  if (ctx == NULL) {
+    // the response of a retransmitted request came twice.
+    STATS(conn->self)->stale_resps++;
+  } else {
+    struct ibv_mr *resp = ctx->resp;
+    bool success = header->type == UD_RESP;
+    if (success && ctx->resp_buf + len > (uint8_t *)resp->addr + resp->length) {
+      fprintf(stderr, "on_recv_ud_resp: response buffer too small.\n");
+      success = false;
+    }
+    if (success)
+      kv_memcpy(ctx->resp_buf, header + 1, len);
+    ctx->cb(conn, success, ctx->req, resp, ctx->cb_arg);
+    if (ctx->auto_resp)
+      slab_free((struct slab_buf *)resp);
+    req_put(conn, ctx);
+  }
+  ud_client_repost(conn, recv);
+  if (!STAILQ_EMPTY(&conn->u.c.pending))
+    ud_flush(conn);
+}
+
+static int ud_established(struct rdma_cm_id *cm_id,
+                          struct rdma_ud_param *param) {
+  struct rdma_connection *conn = cm_id->context;
+  struct kv_rdma *self = conn->self;
+  struct ud_client *ud = conn->u.c.ud;
+  if (param->private_data_len < sizeof(struct ud_private_data)) {
+    conn_refuse(conn);
+    on_disconnect(cm_id);
+    return 0;
+  }
+  const struct ud_private_data *data = param->private_data;
+  TEST_Z(ud->ah = ibv_create_ah(conn->dev->pd, &param->ah_attr));
+  ud->qpn = param->qp_num;
+  ud->qkey = param->qkey;
+  ud->session = data->session;
+  if (data->msg_sz < ud->msg_sz)
+    ud->msg_sz = data->msg_sz;
+  // build_req sends requests up to the size of a datagram.
+  conn->u.c.peer.max_msg_sz = ud->msg_sz - HEADER_SIZE;
+  kv_app_poller_register_on(self->thread_id + conn->thread, ud_retransmit,
+                            conn, self->ud_rto_us / 2, &ud->poller);
+  if (conn->u.c.connect)
+    conn->u.c.connect(conn, conn->u.c.connect_arg);
+  return 0;
+}
+
+static void ud_close(void *arg) {
+  struct rdma_connection *conn = arg;
+  on_disconnect(conn->cm_id);
+}
+
+static void ud_bye_done(void *ctx, __attribute__((unused)) bool success) {
+  struct rdma_connection *conn = ctx;
+  kv_app_send(conn->self->thread_id, ud_close, conn);
+}
+
+// tell the server to drop the session, then tear the connection down like an
+// rc one once the bye has left. the bye is lost if too large to be inlined.
+static void ud_disconnect(void *arg) {
+  struct rdma_connection *conn = arg;
+  struct ud_client *ud = conn->u.c.ud;
+  struct ud_header header = {ud->session, 0, 0, UD_BYE};
+  struct ibv_sge sge = {(uintptr_t)&header, HEADER_SIZE, 0};
+  struct ibv_send_wr wr;
+  memset(&wr, 0, sizeof(wr));
+  wr.wr_id = (uintptr_t)conn;
+  wr.opcode = IBV_WR_SEND;
+  wr.sg_list = &sge;
+  wr.num_sge = 1;
+  wr.send_flags = IBV_SEND_INLINE | IBV_SEND_SIGNALED;
+  wr.wr.ud.ah = ud->ah;
+  wr.wr.ud.remote_qpn = ud->qpn;
+  wr.wr.ud.remote_qkey = ud->qkey;
+  if (conn->max_inline < HEADER_SIZE || sq_post(conn, &wr, 1, ud_bye_done) != 1)
+    ud_close(conn);
+}
+
+static void ud_client_retire(struct rdma_connection *conn) {
+  struct ud_client *ud = conn->u.c.ud;
+  kv_app_poller_unregister(&ud->poller);
+  for (uint32_t i = 0; i < UD_SLOTS; i++)
+    if (ud->slots[i].ctx)
+      req_fail(conn, ud->slots[i].ctx);
+  if (ud->ah)
+    ibv_destroy_ah(ud->ah);
+  kv_rdma_free_bulk(ud->bufs);
+  kv_free(ud);
+  conn->u.c.ud = NULL;
+}
+
+// the qps are destroyed first, so that no response is still being sent.
+static void ud_fini(struct kv_rdma *self) {
+  for (uint32_t i = 0; i < self->dev_num; i++) {
+    struct rdma_device *dev = self->devs + i;
+    for (uint32_t j = 0; dev->ud_msg_sz && j < self->thread_num; j++) {
+      struct ud_endpoint *ep = dev->cq_pollers[j].ud;
+      ibv_destroy_qp(ep->conn.qp);
+      sq_drain(&ep->conn.sq);
+      sq_fini(&ep->conn.sq);
+    }
+  }
+  for (uint32_t i = 0; self->ud_sessions && i < MAX_CONN_NUM; i++)
+    if (self->ud_sessions[i])
+      ud_session_close(self->ud_sessions[i]);
+  kv_free(self->ud_sessions);
+  for (uint32_t i = 0; i < self->dev_num; i++) {
+    struct rdma_device *dev = self->devs + i;
+    for (uint32_t j = 0; dev->ud_msg_sz && j < self->thread_num; j++) {
+      struct ud_endpoint *ep = dev->cq_pollers[j].ud;
+      kv_rdma_free_bulk(ep->bufs);
+      kv_free(ep->mrs);
+      kv_free(ep->requests);
+      kv_free(ep);
+    }
+  }
+}
+
+static int rdma_cq_poller(void *arg);
+static void cq_poller_switch(struct cq_poller_ctx *ctx, bool sleeping) {
+  ctx->sleeping = sleeping;
+  kv_app_poller_unregister(&ctx->poller);
+  ctx->poller = kv_app_poller_register(
+      rdma_cq_poller, ctx, sleeping ? ctx->self->idle_period_us : 0);
+  STATS(ctx->self)->cq_sleeps += sleeping;
+}
+
+// an empty poll in hybrid mode. once the spin budget is spent the cq is
+// armed, and the poller goes to sleep if a last poll still finds nothing.
+static bool cq_poller_idle(struct cq_poller_ctx *ctx) {
+  uint64_t now = now_us();
+  if (ctx->idle_since == 0) {
+    ctx->idle_since = now;
+    return false;
+  }
+  if (now - ctx->idle_since < ctx->self->idle_spin_us)
+    return false;
+  if (!ctx->armed) {
+    TEST_NZ(ibv_req_notify_cq(ctx->cq, 0));
+    ctx->armed = true;
+    // a completion may have come in before the cq was armed.
+    return true;
+  }
+  cq_poller_switch(ctx, true);
+  return false;
+}
+
+// a sleeping poller only wakes up on an event of the channel.
+static bool cq_poller_wake(struct cq_poller_ctx *ctx) {
+  struct ibv_cq *cq;
+  void *cq_ctx;
+  if (ibv_get_cq_event(ctx->channel, &cq, &cq_ctx))
+    return false;
+  ibv_ack_cq_events(cq, 1);
+  ctx->armed = false;
+  ctx->idle_since = 0;
+  cq_poller_switch(ctx, false);
+  return true;
+}
+
+// a flushed ring receive is only counted: its connection may be freed
+// already, and its qp takes no more receives.
+static void on_wc_error(struct cq_poller_ctx *ctx, struct ibv_wc *wc) {
+  switch (wc->wr_id & WR_KIND) {
+  case WR_SEND:
+    on_send_done(wc);
+    break;
+  case WR_RING:
+    if (wc->status != IBV_WC_WR_FLUSH_ERR)
+      fprintf(stderr, "kv_rdma: ring receive status is %d\n", wc->status);
+    STATS(ctx->self)->ring_flushes++;
+    break;
+  case UD_WR_SERVER:
+    on_recv_ud_req(wc);
+    break;
+  case UD_WR_CLIENT:
+    on_recv_ud_resp(wc);
+    break;
+  default:
+    on_recv_req(wc);
+    break;
   }
 }
 
@@ -522,37 +4396,144 @@ static inline void on_send_req(struct ibv_wc *wc) {
 static int rdma_cq_poller(void *arg) {
   struct cq_poller_ctx *ctx = arg;
   struct ibv_wc wc[MAX_ENTRIES_PER_POLL];
-  while (ctx->cq) {
+  if (__atomic_load_n(&ctx->wheel.num, __ATOMIC_RELAXED))
+    expire_reqs(ctx);
+  if (ctx->sleeping && !cq_poller_wake(ctx))
+    return 0;
+  polling = ctx;
+  while (ctx->poller) {
     int rc = ibv_poll_cq(ctx->cq, MAX_ENTRIES_PER_POLL, wc);
-    if (rc <= 0)
+    if (rc == 0 && ctx->channel && cq_poller_idle(ctx))
+      continue;
+    if (rc <= 0) {
+      polling = NULL;
       return rc;
+    }
+    ctx->idle_since = 0;
     for (int i = 0; i < rc; i++) {
+      if (wc[i].status != IBV_WC_SUCCESS) {
+        on_wc_error(ctx, wc + i);
+        continue;
+      }
       switch (wc[i].opcode) {
       case IBV_WC_RECV:
-        on_recv_req(wc + i);
+        if ((wc[i].wr_id & WR_KIND) == UD_WR_SERVER)
+          on_recv_ud_req(wc + i);
+        else if ((wc[i].wr_id & WR_KIND) == UD_WR_CLIENT)
+          on_recv_ud_resp(wc + i);
+        else
+          on_recv_req(wc + i);
         break;
       case IBV_WC_RECV_RDMA_WITH_IMM:
         on_recv_resp(wc + i);
         break;
       case IBV_WC_RDMA_WRITE:
-        on_write_resp_done(wc + i);
-        break;
+      case IBV_WC_RDMA_READ:
+      case IBV_WC_COMP_SWAP:
+      case IBV_WC_FETCH_ADD:
       case IBV_WC_SEND:
-        on_send_req(wc + i);
+        on_send_done(wc + i);
         break;
       default:
         fprintf(stderr, "kv_rdma: unknown event %u \n.", wc[i].opcode);
         break;
       }
     }
+    // inline responses free their receive buffers once posted.
+    resp_flush(&ctx->resp);
+    srq_flush(ctx->dev, &ctx->srq);
   }
+  polling = NULL;
   return 0;
 }
 
 // --- init & fini ---
+void kv_rdma_opts_init(struct kv_rdma_opts *opts) {
+  opts->signal_interval = 16;
+  opts->inline_threshold = 128;
+  opts->rndv_threshold = 64 * 1024;
+  opts->rndv_buf_sz = 4 * 1024 * 1024;
+  opts->rndv_buf_num = 8;
+  opts->reg_cache_size = 1024;
+  opts->slab_size = 64 * 1024 * 1024;
+  opts->auto_resp_sz = 4096;
+  opts->srq_max_num = MAX_Q_NUM;
+  opts->srq_shrink_ms = 10000;
+  opts->credits = 128;
+  opts->req_timeout_ms = 10000;
+  opts->idle_spin_us = 0;
+  opts->idle_period_us = 1000;
+  opts->ud_rto_us = 2000;
+  opts->ud_retries = 8;
+  opts->resp_delay_us = 20;
+}
+
+// open every device the cm knows of, so that buffers registered before the
+// first connection can be used on all of them.
+static void devices_open(struct kv_rdma *self) {
+  int num = 0;
+  if ((self->dev_list = rdma_get_devices(&num)) == NULL || num <= 0)
+    return;
+  self->devs = kv_calloc(num, sizeof(struct rdma_device));
+  for (int i = 0; i < num; i++) {
+    struct rdma_device *dev = self->devs + self->dev_num;
+    dev->self = self;
+    dev->index = self->dev_num;
+    dev->ctx = self->dev_list[i];
+    if (ibv_query_device(dev->ctx, &dev->dev_attr) ||
+        (dev->pd = ibv_alloc_pd(dev->ctx)) == NULL) {
+      fprintf(stderr, "kv_rdma: fail to open %s.\n",
+              ibv_get_device_name(dev->ctx->device));
+      continue;
+    }
+    // async events are polled by the cm poller.
+    int flag = fcntl(dev->ctx->async_fd, F_GETFL);
+    fcntl(dev->ctx->async_fd, F_SETFL, flag | O_NONBLOCK);
+    self->dev_num++;
+  }
+}
+
 void kv_rdma_init(kv_rdma_handle *h, uint32_t thread_num) {
+  kv_rdma_init_with_opts(h, thread_num, NULL);
+}
+
+void kv_rdma_init_with_opts(kv_rdma_handle *h, uint32_t thread_num,
+                            const struct kv_rdma_opts *opts) {
   struct kv_rdma *self = kv_malloc(sizeof(struct kv_rdma));
   kv_memset(self, 0, sizeof(struct kv_rdma));
+  struct kv_rdma_opts default_opts;
+  if (opts == NULL) {
+    kv_rdma_opts_init(&default_opts);
+    opts = &default_opts;
+  }
+  self->signal_interval = opts->signal_interval;
+  if (self->signal_interval == 0)
+    self->signal_interval = 1;
+  if (self->signal_interval > MAX_SIGNAL_INTERVAL)
+    self->signal_interval = MAX_SIGNAL_INTERVAL;
+  self->inline_threshold = opts->inline_threshold;
+  self->rndv_threshold = opts->rndv_threshold;
+  self->rndv_buf_sz = opts->rndv_buf_sz;
+  self->rndv_buf_num = opts->rndv_buf_num;
+  pthread_mutex_init(&self->reg_cache.lock, NULL);
+  pthread_spin_init(&self->export_lock, PTHREAD_PROCESS_PRIVATE);
+  TAILQ_INIT(&self->reg_cache.lru);
+  self->reg_cache.max_idle = opts->reg_cache_size;
+  // requests are only read remotely, responses only written.
+  slab_init(self, self->slabs + SLAB_REQ, opts->slab_size / 2,
+            IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ);
+  slab_init(self, self->slabs + SLAB_RESP, opts->slab_size / 2,
+            IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE);
+  self->auto_resp_sz = opts->auto_resp_sz;
+  self->req_timeout_ms = opts->req_timeout_ms;
+  self->idle_spin_us = opts->idle_spin_us;
+  self->idle_period_us = opts->idle_period_us;
+  self->resp_delay_us = opts->resp_delay_us;
+  self->ud_rto_us = opts->ud_rto_us ? opts->ud_rto_us : 1;
+  self->ud_retries = opts->ud_retries;
+  self->srq_max_num = opts->srq_max_num;
+  self->srq_shrink_ms = opts->srq_shrink_ms;
+  self->credits = opts->credits;
   self->ec = rdma_create_event_channel();
   if (!self->ec) {
     fprintf(stderr, "fail to create event channel.\n");
@@ -560,26 +4541,68 @@ void kv_rdma_init(kv_rdma_handle *h, uint32_t thread_num) {
   }
   int flag = fcntl(self->ec->fd, F_GETFL);
   fcntl(self->ec->fd, F_SETFL, flag | O_NONBLOCK);
+  devices_open(self);
   self->cm_poller = kv_app_poller_register(rdma_cm_poller, self, 1000);
   self->thread_num = thread_num;
   self->thread_id = kv_app_get_thread_index();
   *h = self;
 }
 
+static void device_fini(struct rdma_device *dev) {
+  struct kv_rdma *self = dev->self;
+  for (size_t i = 0; dev->cq_pollers && i < self->thread_num; i++) {
+    struct cq_poller_ctx *poller = dev->cq_pollers + i;
+    // the events not acked yet would make ibv_destroy_cq hang.
+    if (poller->armed && poller->channel) {
+      struct ibv_cq *cq;
+      void *cq_ctx;
+      if (ibv_get_cq_event(poller->channel, &cq, &cq_ctx) == 0)
+        ibv_ack_cq_events(cq, 1);
+    }
+    ibv_destroy_cq(poller->cq);
+    if (poller->channel)
+      ibv_destroy_comp_channel(poller->channel);
+    pthread_spin_destroy(&poller->timer_lock);
+  }
+  kv_free(dev->cq_pollers);
+  if (dev->requests) {
+    ibv_destroy_srq(dev->srq);
+    kv_rdma_free_bulk(dev->mrs);
+    kv_free(dev->requests);
+    struct srq_chunk *chunk;
+    while ((chunk = TAILQ_FIRST(&dev->srq_chunks))) {
+      TAILQ_REMOVE(&dev->srq_chunks, chunk, next);
+      srq_chunk_free(chunk);
+    }
+  }
+}
+
 static void poller_unregister_done(void *arg) {
   struct kv_rdma *self = arg;
   if (--self->fini_ctx.io_cnt)
     return;
-  if (self->ctx) {
-    ibv_destroy_cq(self->cq);
-    ibv_dealloc_pd(self->pd);
-    kv_free(self->cq_pollers);
-    if (self->requests) {
-      ibv_destroy_srq(self->srq);
-      kv_rdma_free_bulk(self->mrs);
-      kv_free(self->requests);
+  ud_fini(self);
+  for (uint32_t i = 0; i < self->dev_num; i++)
+    device_fini(self->devs + i);
+  // every registration is released before the pds.
+  reg_cache_fini(&self->reg_cache);
+  for (uint32_t i = 0; i < SLAB_NUM; i++)
+    slab_fini(self->slabs + i);
+  pthread_spin_destroy(&self->export_lock);
+  if (self->server_ready) {
+    pthread_spin_destroy(&self->rndv_lock);
+    if (self->rndv_mrs) {
+      kv_rdma_free_bulk(self->rndv_mrs);
+      kv_free(self->rndv_free);
     }
   }
+  for (uint32_t i = 0; i < self->dev_num; i++)
+    ibv_dealloc_pd(self->devs[i].pd);
+  kv_free(self->devs);
+  if (self->dev_list)
+    rdma_free_devices(self->dev_list);
+  kv_free(self->conns);
+  kv_free(self->worker_load);
   kv_app_send(self->fini_ctx.thread_id, self->fini_ctx.cb,
               self->fini_ctx.cb_arg);
   kv_free(self);
@@ -587,7 +4610,6 @@ static void poller_unregister_done(void *arg) {
 
 static void cq_poller_unregister(void *arg) {
   struct cq_poller_ctx *ctx = arg;
-  ctx->cq = NULL;
   kv_app_poller_unregister(&ctx->poller);
   kv_app_send(ctx->self->thread_id, poller_unregister_done, ctx->self);
 }
@@ -605,11 +4627,13 @@ void kv_rdma_fini(kv_rdma_handle h, kv_rdma_fini_cb cb, void *cb_arg) {
   self->fini_ctx =
       (struct fini_ctx_t){kv_app_get_thread_index(), 1, cb, cb_arg};
   kv_app_send(self->thread_id, cm_poller_unregister, self);
-  if (self->ctx) {
+  for (uint32_t i = 0; i < self->dev_num; i++) {
+    struct rdma_device *dev = self->devs + i;
+    if (dev->cq_pollers == NULL)
+      continue;
     self->fini_ctx.io_cnt += self->thread_num;
-    for (size_t i = 0; i < self->thread_num; i++) {
-      kv_app_send(self->thread_id + i, cq_poller_unregister,
-                  self->cq_pollers + i);
-    }
+    for (size_t j = 0; j < self->thread_num; j++)
+      kv_app_send(self->thread_id + j, cq_poller_unregister,
+                  dev->cq_pollers + j);
   }
 }
@@ -8,46 +8,399 @@ typedef void *connection_handle;
 typedef void *kv_rdma_handle;
 typedef void *kv_rdma_mr;
 typedef void *kv_rdma_mrs_handle;
+typedef void *kv_rdma_group_handle;
 
 typedef void (*kv_rdma_req_cb)(connection_handle h, bool success,
                                kv_rdma_mr req, kv_rdma_mr resp, void *cb_arg);
 typedef void (*kv_rdma_connect_cb)(connection_handle h, void *cb_arg);
 typedef void (*kv_rdma_disconnect_cb)(void *cb_arg);
+typedef void (*kv_rdma_group_connect_cb)(kv_rdma_group_handle h,
+                                         void *cb_arg);
 typedef void (*kv_rdma_req_handler)(void *req_h, kv_rdma_mr req,
                                     uint32_t req_sz, void *arg);
 typedef void (*kv_rdma_fini_cb)(void *ctx);
 typedef void (*kv_rdma_server_init_cb)(void *arg);
+typedef void (*kv_rdma_resp_cb)(bool success, void *cb_arg);
+typedef void (*kv_rdma_chunk_cb)(connection_handle h, bool success,
+                                 void *stream, uint8_t *chunk, uint32_t len,
+                                 bool last, void *cb_arg);
+
+struct kv_rdma_opts {
+  // only one out of signal_interval send-side WRs of a connection is
+  // signaled, 1 signals every WR. clamped to [1, 128], default 16.
+  uint32_t signal_interval;
+  // requests (header included) and responses up to inline_threshold bytes
+  // are posted with IBV_SEND_INLINE if the device supports it, the buffer of
+  // an inlined request may be reused as soon as the send call returns. 0
+  // disables inline data. default 128.
+  uint32_t inline_threshold;
+  // client: requests with a payload larger than rndv_threshold, or than the
+  // server's max_msg_sz, only send a descriptor and the server pulls the
+  // payload with RDMA READ. their buffers must stay unchanged until the
+  // callback. default 64KiB.
+  uint32_t rndv_threshold;
+  // server: rendezvous requests are pulled into rndv_buf_num buffers of
+  // rndv_buf_sz bytes, requests larger than rndv_buf_sz fail. 0 disables
+  // rendezvous. default 8 buffers of 4MiB.
+  uint32_t rndv_buf_sz;
+  uint32_t rndv_buf_num;
+  // number of unreferenced registrations kept by the registration cache,
+  // the least recently used are deregistered first. default 1024.
+  uint32_t reg_cache_size;
+  // kv_rdma_alloc_req/alloc_resp take their buffers from registered slabs of
+  // slab_size / 2 bytes each, one for requests and one for responses, split
+  // in power-of-two classes from 128B to 1MiB. larger buffers, or all of them
+  // once a slab is used up, are registered on their own. default 64MiB.
+  size_t slab_size;
+  // size of the response buffers taken from the slab when a request is sent
+  // with resp == NULL. default 4KiB.
+  uint32_t auto_resp_sz;
+  // server: when fewer than a quarter of con_req_num receive buffers are left
+  // posted, con_req_num more are added, up to srq_max_num (at most 4096).
+  // the newest extra buffers are given back after srq_shrink_ms without
+  // running low, once requests have consumed them: an idle server keeps them.
+  // default 4096 and 10s.
+  uint32_t srq_max_num;
+  uint32_t srq_shrink_ms;
+  // server: requests each client connection may have outstanding. a client
+  // out of credits queues its requests until responses bring some back, so
+  // con_req_num/srq_max_num should cover the credits of all connections.
+  // 0 disables flow control. default 128.
+  uint32_t credits;
+  // client: a request without a response req_timeout_ms after it was sent
+  // fails through its callback, even if it still waits for credits. its
+  // response buffer may still be written by a late response, which also
+  // brings its credit back. a request may set its own timeout, 0 disables
+  // the timeouts. default 10s.
+  uint32_t req_timeout_ms;
+  // cq pollers busy poll while completions come in. if idle_spin_us is not
+  // 0, a poller without completions for idle_spin_us arms its cq and only
+  // checks the completion channel every idle_period_us until an event wakes
+  // it up. default 0 (always busy poll) and 1ms.
+  uint32_t idle_spin_us;
+  uint32_t idle_period_us;
+  // client of a ud session: a request without a response after ud_rto_us is
+  // sent again, and fails after ud_retries retransmissions. default 2ms and 8.
+  uint32_t ud_rto_us;
+  uint32_t ud_retries;
+  // server: responses made by handlers running in a cq poller are posted
+  // together, one doorbell per connection, at the end of its poll batch. a
+  // response waits at most resp_delay_us for the batch to end, 0 posts each
+  // response right away. default 20us.
+  uint32_t resp_delay_us;
+};
+void kv_rdma_opts_init(struct kv_rdma_opts *opts);
 
 void kv_rdma_init(kv_rdma_handle *h, uint32_t thread_num);
+void kv_rdma_init_with_opts(kv_rdma_handle *h, uint32_t thread_num,
+                            const struct kv_rdma_opts *opts);
 
 void kv_rdma_fini(kv_rdma_handle h, kv_rdma_fini_cb cb, void *cb_arg);
 
-enum kv_rdma_mr_type { KV_RDMA_MR_REQ, KV_RDMA_MR_RESP, KV_RDMA_MR_SERVER };
+// KV_RDMA_MR_ATOMIC buffers are zeroed, 8-byte aligned and also open to remote
+// atomics, like resp buffers they have no header. their allocation returns
+// NULL if a device has no atomic support. any allocation returns NULL if the
+// buffers cannot be registered.
+enum kv_rdma_mr_type {
+  KV_RDMA_MR_REQ,
+  KV_RDMA_MR_RESP,
+  KV_RDMA_MR_SERVER,
+  KV_RDMA_MR_ATOMIC,
+};
 kv_rdma_mrs_handle kv_rdma_alloc_bulk(kv_rdma_handle h,
                                       enum kv_rdma_mr_type type, size_t size,
                                       size_t count);
 kv_rdma_mr kv_rdma_mrs_get(kv_rdma_mrs_handle h, size_t index);
 void kv_rdma_free_bulk(kv_rdma_mrs_handle h);
 
+// buffers are allocated and freed in O(1) from free lists of the calling
+// kv_app thread, they may be freed on any kv_app thread. request buffers can
+// only be read remotely, response buffers only written. kv_rdma_free_mr takes
+// only buffers of kv_rdma_alloc_req/alloc_resp, other handles are ignored.
 kv_rdma_mr kv_rdma_alloc_req(kv_rdma_handle h, uint32_t size);
 uint8_t *kv_rdma_get_req_buf(kv_rdma_mr mr);
 kv_rdma_mr kv_rdma_alloc_resp(kv_rdma_handle h, uint32_t size);
 uint8_t *kv_rdma_get_resp_buf(kv_rdma_mr mr);
 void kv_rdma_free_mr(kv_rdma_mr h);
 
+// register application memory through the registration cache, a region
+// already covering [addr, addr + len) is reused. the returned mr may start
+// before addr, its offset is addr - kv_rdma_get_resp_buf(mr). the memory must
+// be writable. returns NULL on failure.
+kv_rdma_mr kv_rdma_reg_mem(kv_rdma_handle h, void *addr, size_t len);
+// release a region of kv_rdma_reg_mem, it stays cached while unreferenced.
+void kv_rdma_dereg_mem(kv_rdma_handle h, kv_rdma_mr mr);
+// must be called before memory which may be cached is freed or unmapped.
+void kv_rdma_reg_invalidate(kv_rdma_handle h, void *addr, size_t len);
+
+// a segment of a registered memory region.
+struct kv_rdma_sge {
+  kv_rdma_mr mr;
+  uint32_t offset; // from the start of mr
+  uint32_t length;
+};
+#define KV_RDMA_MAX_SGE (7U)
+
 void kv_rdma_listen(kv_rdma_handle h, char *addr_str, char *port_str,
                     uint32_t con_req_num, uint32_t max_msg_sz,
                     kv_rdma_req_handler handler, void *arg,
                     kv_rdma_server_init_cb cb, void *cb_arg);
+// where the handlers of a server run.
+enum kv_rdma_dispatch_mode {
+  // in the cq poller which received the request, the default. a slow handler
+  // delays the completions of all the connections of its poller.
+  KV_RDMA_DISPATCH_INLINE,
+  // on kv_app thread first_worker.
+  KV_RDMA_DISPATCH_PINNED,
+  // on the kv_app threads [first_worker, first_worker + worker_num), each
+  // request goes to the one with the fewest requests not responded to yet.
+  KV_RDMA_DISPATCH_POOL,
+};
+struct kv_rdma_dispatch {
+  enum kv_rdma_dispatch_mode mode;
+  uint32_t first_worker;
+  uint32_t worker_num;
+};
+// kv_rdma_listen with its handlers, and those of kv_rdma_listen_ud, run as
+// dispatch says. NULL runs them inline. the response may then be made on the
+// worker thread or on any other kv_app thread.
+void kv_rdma_listen_with_dispatch(kv_rdma_handle h, char *addr_str,
+                                  char *port_str, uint32_t con_req_num,
+                                  uint32_t max_msg_sz,
+                                  kv_rdma_req_handler handler, void *arg,
+                                  kv_rdma_server_init_cb cb, void *cb_arg,
+                                  const struct kv_rdma_dispatch *dispatch);
 void kv_rdma_make_resp(void *req_h, uint8_t *resp,
                        uint32_t resp_sz); // resp must within buf
+// get a buffer of up to opts.rndv_buf_sz bytes for a response larger than the
+// request buffer, the response must then be made within it. returns NULL if no
+// large buffer is available.
+uint8_t *kv_rdma_alloc_large_resp(void *req_h, uint32_t size);
+// gather the response from several registered regions, which must stay
+// unchanged until cb is called.
+void kv_rdma_make_resp_sg(void *req_h, struct kv_rdma_sge *sges,
+                          uint32_t sge_num, kv_rdma_resp_cb cb, void *cb_arg);
 uint32_t kv_rdma_conn_num(kv_rdma_handle h);
+// the rkey of mr for the client of a request, to hand out in the response
+// for its one-sided operations.
+uint32_t kv_rdma_req_rkey(void *req_h, kv_rdma_mr mr);
+// a request of kv_rdma_send_stream is answered by chunks instead of a
+// response: each kv_rdma_stream_write writes len bytes of mr at offset into
+// the next slot of the client's ring, once the client has acknowledged the
+// slot free. exactly one chunk, the last one, has last set, and the receive
+// buffer of the request is reused once it is posted. mr must stay unchanged
+// until cb is called, and may be NULL for an empty chunk. a chunk larger than
+// the ring's slots fails.
+bool kv_rdma_req_is_stream(void *req_h);
+void kv_rdma_stream_write(void *req_h, kv_rdma_mr mr, uint32_t offset,
+                          uint32_t len, bool last, kv_rdma_resp_cb cb,
+                          void *cb_arg);
+// a region exported by a server, as its clients see it.
+#define KV_RDMA_NAME_LEN (32U)
+#define KV_RDMA_MAX_EXPORTS (64U)
+struct kv_rdma_region {
+  char name[KV_RDMA_NAME_LEN]; // nul-terminated
+  uint64_t addr;
+  uint64_t len;
+  uint32_t rkey; // on the device of the client's connection
+};
+// publish mr under name, for the one-sided operations of the clients which
+// connect from now on. each client gets the directory of the exported
+// regions while it connects, before its connect_cb. returns false if name is
+// empty or too long, or if KV_RDMA_MAX_EXPORTS regions are exported already.
+bool kv_rdma_export(kv_rdma_handle h, const char *name, kv_rdma_mr mr);
+// pass the one-way messages of kv_rdma_send_msg to handler, run like the
+// request handlers. its req_h must not be responded to, the message buffer is
+// reused once the handler returns. messages are dropped while no handler is
+// set.
+void kv_rdma_set_msg_handler(kv_rdma_handle h, kv_rdma_req_handler handler,
+                             void *arg);
+// serve requests over unreliable datagrams too: each cq poller owns one ud qp
+// with recv_num receives, shared by all the ud sessions it serves. requests
+// and responses must fit a datagram (the path mtu). a retransmitted request
+// runs once, its response is sent again.
+void kv_rdma_listen_ud(kv_rdma_handle h, char *addr_str, char *port_str,
+                       uint32_t recv_num, kv_rdma_req_handler handler,
+                       void *arg);
+
+struct kv_rdma_stats {
+  uint32_t inline_threshold;
+  uint32_t max_inline_data; // granted by the device
+  uint64_t reqs, inline_reqs, rndv_reqs;
+  uint64_t credit_waits; // requests queued for lack of credits
+  uint64_t timeouts, stale_resps;
+  uint64_t cq_sleeps; // times a cq poller went to sleep
+  uint64_t resps, inline_resps;
+  uint64_t resp_doorbells; // ibv_post_send calls carrying responses
+  uint64_t ud_retransmits;
+  uint64_t ring_flushes; // client receives flushed by a torn down qp
+  uint32_t srq_bufs; // receive buffers currently owned by the srq
+  uint64_t srq_limit_events;
+  uint64_t reg_hits, reg_misses, reg_evictions;
+};
+void kv_rdma_get_stats(kv_rdma_handle h, struct kv_rdma_stats *stats);
 
 void kv_rdma_connect(kv_rdma_handle h, char *addr_str, char *port_str,
                      kv_rdma_connect_cb connect_cb, void *connect_arg,
                      kv_rdma_disconnect_cb disconnect_cb, void *disconnect_arg);
+// bind the connection to the device, and so the rail, of a local address.
+void kv_rdma_connect_from(kv_rdma_handle h, char *src_addr_str,
+                          char *addr_str, char *port_str,
+                          kv_rdma_connect_cb connect_cb, void *connect_arg,
+                          kv_rdma_disconnect_cb disconnect_cb,
+                          void *disconnect_arg);
+// open a ud session with a server of kv_rdma_listen_ud. at most 8 of its
+// requests are in flight, the others wait in order. requests have no
+// deadline, they fail after opts.ud_retries retransmissions instead.
+void kv_rdma_connect_ud(kv_rdma_handle h, char *addr_str, char *port_str,
+                        kv_rdma_connect_cb connect_cb, void *connect_arg,
+                        kv_rdma_disconnect_cb disconnect_cb,
+                        void *disconnect_arg);
+// if resp is NULL, a buffer of opts.auto_resp_sz bytes is taken from the slab
+// and freed once cb returns, the response must fit in it.
 void kv_rdma_send_req(connection_handle h, kv_rdma_mr req, uint32_t req_sz,
                       kv_rdma_mr resp, void *resp_addr, kv_rdma_req_cb cb,
                       void *cb_arg);
+// requests of one batch are chained and posted with a single doorbell.
+struct kv_rdma_req {
+  kv_rdma_mr req;
+  uint32_t req_sz;
+  kv_rdma_mr resp;
+  void *resp_addr;
+  kv_rdma_req_cb cb;
+  void *cb_arg;
+  // if sge_num is not 0, the payload is gathered from sges, req only holds
+  // the header and req_sz is ignored.
+  struct kv_rdma_sge *sges;
+  uint32_t sge_num;
+  uint32_t timeout_ms; // 0 uses opts.req_timeout_ms
+  bool oneway;         // see kv_rdma_send_msg, resp is ignored
+};
+void kv_rdma_send_req_batch(connection_handle h, struct kv_rdma_req *reqs,
+                            uint32_t num);
+// send a request whose payload is gathered from up to KV_RDMA_MAX_SGE
+// segments without copying, req may be allocated with a size of 0.
+void kv_rdma_send_req_sg(connection_handle h, kv_rdma_mr req,
+                         struct kv_rdma_sge *sges, uint32_t sge_num,
+                         kv_rdma_mr resp, void *resp_addr, kv_rdma_req_cb cb,
+                         void *cb_arg);
+// send a one-way message to the msg handler of the server, which makes no
+// response. cb gets a NULL resp, and is called once req may be reused. a
+// message must fit the server's receive buffers and can't go over a ud
+// session. it takes a credit, which the server gives back on its own.
+void kv_rdma_send_msg(connection_handle h, kv_rdma_mr req, uint32_t req_sz,
+                      kv_rdma_req_cb cb, void *cb_arg);
+// send a request answered by a stream of chunks, written into the slot_num
+// slots of slot_sz bytes of ring, from ring_addr. cb gets each chunk in
+// order with its slot, the last one with last set, after which the stream is
+// done with. a failed stream ends with a failed last chunk. the server writes
+// up to slot_num chunks ahead, a slot is free again once acknowledged by
+// kv_rdma_stream_ack, which must not follow the last chunk. streams have no
+// deadline, can't go over a ud session and take their credit until they end.
+// the request must be sent without rendezvous, and each connection has rings
+// of at most 512 slots in all.
+void kv_rdma_send_stream(connection_handle h, kv_rdma_mr req, uint32_t req_sz,
+                         kv_rdma_mr ring, void *ring_addr, uint32_t slot_sz,
+                         uint32_t slot_num, kv_rdma_chunk_cb cb, void *cb_arg);
+// the regions exported by the server when the connection was set up, valid
+// until its disconnect_cb returns. a ud session has none.
+uint32_t kv_rdma_get_regions(connection_handle h,
+                             const struct kv_rdma_region **regions);
+// NULL if the server exported no region under name.
+const struct kv_rdma_region *kv_rdma_find_region(connection_handle h,
+                                                 const char *name);
+// free the oldest slots of a stream's ring. at most one acknowledgement per
+// stream is in flight. it takes a credit like a request, which the following
+// chunk gives back, and waits for one if none is left.
+void kv_rdma_stream_ack(connection_handle h, void *stream, uint32_t slots);
+// one-sided operations on the memory of the server, at remote_addr under an
+// rkey it has handed out. they take no credit and involve no handler. len
+// bytes of mr at offset are written there, or read into. cb is called once
+// the operation is complete, on the cq poller of the connection.
+// the atomics work on the 8-byte word at remote_addr, which must be aligned
+// and in a KV_RDMA_MR_ATOMIC buffer, and read its old value into mr at
+// offset, len is ignored. KV_RDMA_CAS swaps in swap if the word equals
+// compare_add, KV_RDMA_FAA adds compare_add to it. they are atomic only
+// against the other remote atomics on the word, not against its cpu accesses.
+enum kv_rdma_rw_op { KV_RDMA_READ, KV_RDMA_WRITE, KV_RDMA_CAS, KV_RDMA_FAA };
+struct kv_rdma_rw {
+  enum kv_rdma_rw_op op;
+  kv_rdma_mr mr;
+  uint32_t offset;
+  uint32_t len;
+  uint64_t remote_addr;
+  uint32_t rkey;
+  kv_rdma_resp_cb cb;
+  void *cb_arg;
+  uint64_t compare_add;
+  uint64_t swap;
+};
+// operations of one batch are chained and posted with a single doorbell. they
+// can't go over a ud session.
+void kv_rdma_rw_batch(connection_handle h, struct kv_rdma_rw *ops,
+                      uint32_t num);
+void kv_rdma_read(connection_handle h, kv_rdma_mr mr, uint32_t offset,
+                  uint32_t len, uint64_t remote_addr, uint32_t rkey,
+                  kv_rdma_resp_cb cb, void *cb_arg);
+void kv_rdma_write(connection_handle h, kv_rdma_mr mr, uint32_t offset,
+                   uint32_t len, uint64_t remote_addr, uint32_t rkey,
+                   kv_rdma_resp_cb cb, void *cb_arg);
+void kv_rdma_cmp_swap(connection_handle h, kv_rdma_mr mr, uint32_t offset,
+                      uint64_t remote_addr, uint32_t rkey, uint64_t compare,
+                      uint64_t swap, kv_rdma_resp_cb cb, void *cb_arg);
+void kv_rdma_fetch_add(connection_handle h, kv_rdma_mr mr, uint32_t offset,
+                       uint64_t remote_addr, uint32_t rkey, uint64_t add,
+                       kv_rdma_resp_cb cb, void *cb_arg);
+// the kv_app thread polling the connection, callbacks of its requests always
+// run on this thread.
+uint32_t kv_rdma_conn_thread(connection_handle h);
 void kv_rdma_disconnect(connection_handle h);
+
+// how a group spreads its requests over its connections.
+enum kv_rdma_group_policy {
+  KV_RDMA_GROUP_ROUND_ROBIN,
+  KV_RDMA_GROUP_LEAST_OUTSTANDING, // the fewest requests in flight
+  KV_RDMA_GROUP_HASH,              // hash(req) modulo the group size
+};
+typedef uint32_t (*kv_rdma_group_hash)(const struct kv_rdma_req *req,
+                                       void *arg);
+struct kv_rdma_group_opts {
+  uint32_t qps; // connections per local address, default 1
+  enum kv_rdma_group_policy policy; // default round-robin
+  kv_rdma_group_hash hash;          // required by KV_RDMA_GROUP_HASH
+  void *hash_arg;
+};
+void kv_rdma_group_opts_init(struct kv_rdma_group_opts *opts);
+// a group connects to the same server opts.qps times from each of the
+// src_num local addresses, typically one per port, and spreads the requests
+// sent through it over its connections. buffers are registered on every
+// device, any of them may be sent on any connection of the group. opts may be
+// NULL. connect_cb gets NULL if a connection fails, the others are then
+// closed. disconnect_cb is called once all the connections are gone.
+// connection callbacks run on the thread of kv_rdma_init.
+void kv_rdma_group_connect(kv_rdma_handle h, char **src_addrs,
+                           uint32_t src_num, char *addr_str, char *port_str,
+                           const struct kv_rdma_group_opts *opts,
+                           kv_rdma_group_connect_cb connect_cb,
+                           void *connect_arg,
+                           kv_rdma_disconnect_cb disconnect_cb,
+                           void *disconnect_arg);
+// the connection req goes to according to the policy of the group, req may be
+// NULL unless the group hashes. the connections torn down are skipped, a
+// request for one goes to the next live one. NULL once none is left, the
+// requests sent through the group then fail.
+connection_handle kv_rdma_group_pick(kv_rdma_group_handle h,
+                                     const struct kv_rdma_req *req);
+uint32_t kv_rdma_group_size(kv_rdma_group_handle h);
+// the connections alternate over the local addresses by index. NULL if the
+// connection at index is torn down.
+connection_handle kv_rdma_group_conn(kv_rdma_group_handle h, uint32_t index);
+void kv_rdma_group_send_req(kv_rdma_group_handle h, kv_rdma_mr req,
+                            uint32_t req_sz, kv_rdma_mr resp, void *resp_addr,
+                            kv_rdma_req_cb cb, void *cb_arg);
+// a batch goes to the connection of its first request, to keep one doorbell
+// per batch.
+void kv_rdma_group_send_req_batch(kv_rdma_group_handle h,
+                                  struct kv_rdma_req *reqs, uint32_t num);
+void kv_rdma_group_disconnect(kv_rdma_group_handle h);
 #endif
\ No newline at end of file
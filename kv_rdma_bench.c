@@ -0,0 +1,338 @@
+#include "kv_rdma.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "kv_app.h"
+
+// usage:
+//   kv_rdma_bench <json_config> server <addr> <port> [threads]
+//   kv_rdma_bench <json_config> client|ud <addr> <port> [threads] [depth]
+//                 [batch] [total] [src_addr,src_addr,...]
+// the client opens one connection per thread and runs the same workload twice
+// on each of them, first through kv_rdma_send_req and then through
+// kv_rdma_send_req_batch, and reports the aggregate throughput of both. run it
+// with 1 to N threads to see how the cq pollers scale. with several local
+// addresses, one per port, the connections are spread over the rails.
+// if the devices support atomics, the server exports a counter and each
+// client thread then adds to it ATOMIC_OPS times, checking the old values the
+// fetch-and-adds return and the final value with a compare-and-swap, which
+// resets it. only one client should run at a time.
+// the ud client runs the same workload over ud sessions instead. the server
+// holds back one of every HOLD_EVERY of their requests for HOLD_US, past the
+// default ud_rto_us, so that they are retransmitted: the copies that come in
+// meanwhile are dropped, and the later ones get the kept response again.
+
+#define REQ_SZ (16U)
+#define MAX_DEPTH (4096U)
+#define MAX_BATCH (256U)
+#define MAX_RAILS (8U)
+#define ATOMIC_OPS (1000U)
+#define COUNTER "bench.counter"
+#define HOLD_EVERY (1000U)
+#define HOLD_US (6000U)
+
+struct worker {
+  connection_handle conn;
+  kv_rdma_mrs_handle reqs, resps;
+  uint32_t free_slots[MAX_DEPTH], free_num;
+  uint32_t round, issued, done, total;
+  uint64_t start;
+  double mops[2];
+  uint32_t atomics, atomic_errors;
+  uint64_t last_old;
+};
+
+// a ud request the server answers late, one per cq poller thread.
+struct held {
+  void *poller;
+  void *req_h;
+  kv_rdma_mr req;
+  uint32_t req_sz, count;
+  uint64_t due;
+};
+
+static struct {
+  char *addr, *port;
+  bool ud;
+  char *rails[MAX_RAILS];
+  uint32_t rail_num;
+  uint32_t threads, depth, batch, total;
+  kv_rdma_handle rdma;
+  struct worker *workers;
+  uint32_t connected, finished;
+  bool counter_ok;
+  struct held held[MAX_TASKS_NUM];
+} g;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// --- server ---
+static void handler(void *req_h, kv_rdma_mr req, uint32_t req_sz, void *arg) {
+  kv_rdma_make_resp(req_h, kv_rdma_get_req_buf(req), req_sz);
+}
+
+static int held_release(void *arg) {
+  struct held *h = arg;
+  if (h->req_h == NULL || now_ns() < h->due)
+    return 0;
+  handler(h->req_h, h->req, h->req_sz, NULL);
+  h->req_h = NULL;
+  return 1;
+}
+
+static void ud_handler(void *req_h, kv_rdma_mr req, uint32_t req_sz,
+                       void *arg) {
+  struct held *h = g.held + kv_app_get_thread_index();
+  if (h->req_h || ++h->count % HOLD_EVERY) {
+    handler(req_h, req, req_sz, arg);
+    return;
+  }
+  if (h->poller == NULL)
+    h->poller = kv_app_poller_register(held_release, h, HOLD_US / 4);
+  *h = (struct held){h->poller, req_h, req, req_sz, h->count,
+                     now_ns() + HOLD_US * 1000ULL};
+}
+
+static void server_start(void *arg) {
+  kv_rdma_init(&g.rdma, g.threads);
+  kv_rdma_mrs_handle counter =
+      kv_rdma_alloc_bulk(g.rdma, KV_RDMA_MR_ATOMIC, sizeof(uint64_t), 1);
+  if (counter)
+    kv_rdma_export(g.rdma, COUNTER, kv_rdma_mrs_get(counter, 0));
+  kv_rdma_listen(g.rdma, g.addr, g.port, 1024, 4096, handler, NULL, NULL,
+                 NULL);
+  // datagrams have their own port space.
+  kv_rdma_listen_ud(g.rdma, g.addr, g.port, 1024, ud_handler, NULL);
+}
+
+// --- client ---
+static void stop_all(void *arg) { kv_app_stop(0); }
+
+static void client_fini(void *arg) {
+  double mops[2] = {0, 0};
+  for (uint32_t i = 0; i < g.threads; i++) {
+    mops[0] += g.workers[i].mops[0];
+    mops[1] += g.workers[i].mops[1];
+  }
+  printf("threads %u, depth %u, %u requests per thread\n", g.threads, g.depth,
+         g.total);
+  printf("kv_rdma_send_req: %.3f Mops/s\n", mops[0]);
+  printf("kv_rdma_send_req_batch(%u): %.3f Mops/s\n", g.batch, mops[1]);
+  struct kv_rdma_stats stats;
+  kv_rdma_get_stats(g.rdma, &stats);
+  printf("inline threshold %u (device %u), %lu of %lu requests inlined\n",
+         stats.inline_threshold, stats.max_inline_data, stats.inline_reqs,
+         stats.reqs);
+  printf("%lu requests waited for credits, %lu timed out\n",
+         stats.credit_waits, stats.timeouts);
+  if (g.ud)
+    printf("ud: %lu retransmissions, %lu duplicate responses\n",
+           stats.ud_retransmits, stats.stale_resps);
+  if (kv_rdma_find_region(g.workers[0].conn, COUNTER)) {
+    uint32_t errors = 0;
+    for (uint32_t i = 0; i < g.threads; i++)
+      errors += g.workers[i].atomic_errors;
+    printf("atomics: %u fetch-and-adds per thread, %u bad old values, "
+           "final value %s\n",
+           ATOMIC_OPS, errors, g.counter_ok ? "ok" : "wrong");
+  }
+  for (uint32_t i = 0; i < g.threads; i++) {
+    kv_rdma_free_bulk(g.workers[i].reqs);
+    kv_rdma_free_bulk(g.workers[i].resps);
+    kv_rdma_disconnect(g.workers[i].conn);
+  }
+  free(g.workers);
+  kv_rdma_fini(g.rdma, stop_all, NULL);
+}
+
+static void issue(struct worker *w);
+static void round_start(struct worker *w) {
+  w->issued = w->done = 0;
+  w->start = now_ns();
+  issue(w);
+}
+
+// the old value of an atomic lands in the first response buffer.
+static uint64_t atomic_old(struct worker *w) {
+  uint64_t old;
+  memcpy(&old, kv_rdma_get_resp_buf(kv_rdma_mrs_get(w->resps, 0)),
+         sizeof(old));
+  return old;
+}
+
+static void counter_checked(bool success, void *arg) {
+  struct worker *w = arg;
+  g.counter_ok = success && atomic_old(w) == (uint64_t)g.threads * ATOMIC_OPS;
+  kv_app_send(0, client_fini, NULL);
+}
+
+// the last worker to finish checks the counter, and resets it.
+static void worker_finish(struct worker *w) {
+  if (__atomic_add_fetch(&g.finished, 1, __ATOMIC_SEQ_CST) < g.threads)
+    return;
+  const struct kv_rdma_region *r = kv_rdma_find_region(w->conn, COUNTER);
+  if (r == NULL) {
+    kv_app_send(0, client_fini, NULL);
+    return;
+  }
+  kv_rdma_cmp_swap(w->conn, kv_rdma_mrs_get(w->resps, 0), 0, r->addr,
+                   r->rkey, (uint64_t)g.threads * ATOMIC_OPS, 0,
+                   counter_checked, w);
+}
+
+static void atomic_issue(struct worker *w);
+// the other workers only add to the counter too, so each old value of a
+// worker is larger than its previous one.
+static void atomic_done(bool success, void *arg) {
+  struct worker *w = arg;
+  uint64_t old = atomic_old(w);
+  if (!success || (w->atomics && old <= w->last_old))
+    w->atomic_errors++;
+  w->last_old = old;
+  if (++w->atomics < ATOMIC_OPS) {
+    atomic_issue(w);
+    return;
+  }
+  worker_finish(w);
+}
+
+static void atomic_issue(struct worker *w) {
+  const struct kv_rdma_region *r = kv_rdma_find_region(w->conn, COUNTER);
+  kv_rdma_fetch_add(w->conn, kv_rdma_mrs_get(w->resps, 0), 0, r->addr,
+                    r->rkey, 1, atomic_done, w);
+}
+
+static void round_end(struct worker *w) {
+  w->mops[w->round] = w->total / ((now_ns() - w->start) / 1e3);
+  if (++w->round < 2) {
+    round_start(w);
+    return;
+  }
+  if (kv_rdma_find_region(w->conn, COUNTER))
+    atomic_issue(w);
+  else
+    worker_finish(w);
+}
+
+static void req_done(connection_handle h, bool success, kv_rdma_mr req,
+                     kv_rdma_mr resp, void *arg) {
+  struct worker *w = g.workers + ((uintptr_t)arg >> 32);
+  if (!success)
+    fprintf(stderr, "bench: request failed.\n");
+  w->free_slots[w->free_num++] = (uint32_t)(uintptr_t)arg;
+  if (++w->done == w->total) {
+    round_end(w);
+    return;
+  }
+  issue(w);
+}
+
+static void issue(struct worker *w) {
+  struct kv_rdma_req reqs[MAX_BATCH];
+  uint32_t batch = w->round == 0 ? 1 : g.batch;
+  uintptr_t id = (uintptr_t)(w - g.workers) << 32;
+  while (w->issued < w->total) {
+    uint32_t n = w->total - w->issued < batch ? w->total - w->issued : batch;
+    if (w->free_num < n)
+      return;
+    for (uint32_t i = 0; i < n; i++) {
+      uint32_t slot = w->free_slots[--w->free_num];
+      reqs[i] = (struct kv_rdma_req){kv_rdma_mrs_get(w->reqs, slot),
+                                     REQ_SZ,
+                                     kv_rdma_mrs_get(w->resps, slot),
+                                     NULL,
+                                     req_done,
+                                     (void *)(id | slot)};
+    }
+    w->issued += n;
+    if (w->round == 0)
+      kv_rdma_send_req(w->conn, reqs[0].req, reqs[0].req_sz, reqs[0].resp,
+                       reqs[0].resp_addr, reqs[0].cb, reqs[0].cb_arg);
+    else
+      kv_rdma_send_req_batch(w->conn, reqs, n);
+  }
+}
+
+static void worker_start(void *arg) { round_start(arg); }
+
+static void connected(connection_handle h, void *arg) {
+  struct worker *w = arg;
+  if (h == NULL) {
+    fprintf(stderr, "bench: fail to connect to %s:%s.\n", g.addr, g.port);
+    exit(-1);
+  }
+  w->conn = h;
+  w->total = g.total;
+  w->reqs = kv_rdma_alloc_bulk(g.rdma, KV_RDMA_MR_REQ, REQ_SZ, g.depth);
+  w->resps = kv_rdma_alloc_bulk(g.rdma, KV_RDMA_MR_RESP, REQ_SZ, g.depth);
+  if (w->reqs == NULL || w->resps == NULL) {
+    fprintf(stderr, "bench: fail to allocate the buffers.\n");
+    exit(-1);
+  }
+  for (uint32_t i = 0; i < g.depth; i++) {
+    memset(kv_rdma_get_req_buf(kv_rdma_mrs_get(w->reqs, i)), 'a', REQ_SZ);
+    w->free_slots[w->free_num++] = i;
+  }
+  if (++g.connected < g.threads)
+    return;
+  // issue requests from the thread polling each connection.
+  for (uint32_t i = 0; i < g.threads; i++)
+    kv_app_send(kv_rdma_conn_thread(g.workers[i].conn), worker_start,
+                g.workers + i);
+}
+
+static void client_exit(void *arg) {}
+
+static void client_start(void *arg) {
+  kv_rdma_init(&g.rdma, g.threads);
+  g.workers = calloc(g.threads, sizeof(struct worker));
+  for (uint32_t i = 0; i < g.threads; i++)
+    if (g.ud)
+      kv_rdma_connect_ud(g.rdma, g.addr, g.port, connected, g.workers + i,
+                         client_exit, NULL);
+    else
+      kv_rdma_connect_from(g.rdma,
+                           g.rail_num ? g.rails[i % g.rail_num] : NULL, g.addr,
+                           g.port, connected, g.workers + i, client_exit,
+                           NULL);
+}
+
+int main(int argc, char **argv) {
+  if (argc < 5) {
+    fprintf(stderr,
+            "usage: %s <json_config> server|client|ud <addr> <port> "
+            "[threads] [depth] [batch] [total] [src_addr,...]\n",
+            argv[0]);
+    return -1;
+  }
+  g.addr = argv[3];
+  g.port = argv[4];
+  g.ud = strcmp(argv[2], "ud") == 0;
+  g.threads = argc > 5 ? atoi(argv[5]) : 1;
+  g.depth = argc > 6 ? atoi(argv[6]) : 256;
+  g.batch = argc > 7 ? atoi(argv[7]) : 16;
+  g.total = argc > 8 ? atoi(argv[8]) : 1000000;
+  for (char *rail = argc > 9 ? strtok(argv[9], ",") : NULL;
+       rail && g.rail_num < MAX_RAILS; rail = strtok(NULL, ","))
+    g.rails[g.rail_num++] = rail;
+  if (g.threads == 0 || g.threads >= MAX_TASKS_NUM)
+    g.threads = 1;
+  if (g.depth > MAX_DEPTH)
+    g.depth = MAX_DEPTH;
+  if (g.batch > MAX_BATCH)
+    g.batch = MAX_BATCH;
+  if (g.batch > g.depth)
+    g.batch = g.depth;
+  struct kv_app_task *tasks = calloc(g.threads, sizeof(struct kv_app_task));
+  tasks[0].func = strcmp(argv[2], "server") == 0 ? server_start : client_start;
+  kv_app_start(argv[1], g.threads, tasks);
+  free(tasks);
+  return 0;
+}
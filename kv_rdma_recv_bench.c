@@ -0,0 +1,112 @@
+#include <infiniband/verbs.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// usage:
+//   kv_rdma_recv_bench [device] [count] [max_batch]
+// measures the cost of replenishing a srq, as the server does once per
+// request, when receives are posted one per ibv_post_srq_recv (batch 1, the
+// old behavior) and when those of a poll batch are chained into one call.
+// the srq is recreated whenever it is full, out of the timed section.
+
+#define SRQ_DEPTH (4096U)
+#define BUF_SZ (4096U)
+#define MAX_BATCH (256U)
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static struct ibv_srq *srq_create(struct ibv_pd *pd) {
+  struct ibv_srq_init_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.attr.max_wr = SRQ_DEPTH;
+  attr.attr.max_sge = 1;
+  struct ibv_srq *srq = ibv_create_srq(pd, &attr);
+  if (srq == NULL) {
+    fprintf(stderr, "recv_bench: fail to create srq.\n");
+    exit(-1);
+  }
+  return srq;
+}
+
+static double run(struct ibv_pd *pd, struct ibv_mr *mr, uint32_t count,
+                  uint32_t batch) {
+  struct ibv_recv_wr wrs[MAX_BATCH], *bad_wr = NULL;
+  struct ibv_sge sges[MAX_BATCH];
+  struct ibv_srq *srq = srq_create(pd);
+  uint64_t elapsed = 0;
+  uint32_t posted = 0, in_srq = 0;
+  while (posted < count) {
+    if (in_srq + batch > SRQ_DEPTH) {
+      ibv_destroy_srq(srq);
+      srq = srq_create(pd);
+      in_srq = 0;
+    }
+    for (uint32_t i = 0; i < batch; i++) {
+      uint32_t slot = in_srq + i;
+      sges[i] = (struct ibv_sge){(uintptr_t)mr->addr + slot * BUF_SZ, BUF_SZ,
+                                 mr->lkey};
+      wrs[i] = (struct ibv_recv_wr){slot, wrs + i + 1, sges + i, 1};
+    }
+    wrs[batch - 1].next = NULL;
+    uint64_t start = now_ns();
+    if (ibv_post_srq_recv(srq, wrs, &bad_wr)) {
+      fprintf(stderr, "recv_bench: ibv_post_srq_recv failed.\n");
+      exit(-1);
+    }
+    elapsed += now_ns() - start;
+    posted += batch;
+    in_srq += batch;
+  }
+  ibv_destroy_srq(srq);
+  return (double)elapsed / posted;
+}
+
+int main(int argc, char **argv) {
+  uint32_t count = argc > 2 ? atoi(argv[2]) : 1000000;
+  uint32_t max_batch = argc > 3 ? atoi(argv[3]) : 128;
+  if (max_batch == 0 || max_batch > MAX_BATCH)
+    max_batch = MAX_BATCH;
+  int num;
+  struct ibv_device **devs = ibv_get_device_list(&num), *dev = NULL;
+  for (int i = 0; devs && i < num; i++)
+    if (argc < 2 || strcmp(argv[1], ibv_get_device_name(devs[i])) == 0) {
+      dev = devs[i];
+      break;
+    }
+  if (dev == NULL) {
+    fprintf(stderr, "recv_bench: no rdma device found.\n");
+    return -1;
+  }
+  struct ibv_context *ctx = ibv_open_device(dev);
+  struct ibv_pd *pd = ctx ? ibv_alloc_pd(ctx) : NULL;
+  void *buf = calloc(SRQ_DEPTH, BUF_SZ);
+  struct ibv_mr *mr =
+      pd ? ibv_reg_mr(pd, buf, SRQ_DEPTH * BUF_SZ, IBV_ACCESS_LOCAL_WRITE)
+         : NULL;
+  if (mr == NULL) {
+    fprintf(stderr, "recv_bench: fail to set up %s.\n",
+            ibv_get_device_name(dev));
+    return -1;
+  }
+  printf("%s, %u receives per run\n", ibv_get_device_name(dev), count);
+  double base = 0;
+  for (uint32_t batch = 1; batch <= max_batch; batch *= 2) {
+    double ns = run(pd, mr, count, batch);
+    if (batch == 1)
+      base = ns;
+    printf("batch %3u: %7.1f ns per receive (%.2fx)\n", batch, ns, base / ns);
+  }
+  ibv_dereg_mr(mr);
+  free(buf);
+  ibv_dealloc_pd(pd);
+  ibv_close_device(ctx);
+  ibv_free_device_list(devs);
+  return 0;
+}
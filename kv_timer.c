@@ -0,0 +1,81 @@
+#include "kv_timer.h"
+
+#define SLOT_MASK (KV_TIMER_SLOTS - 1)
+#define LEVEL_SPAN(l) (1ULL << (KV_TIMER_BITS * ((l) + 1)))
+
+void kv_timer_wheel_init(struct kv_timer_wheel *wheel, uint64_t now) {
+  wheel->now = now;
+  wheel->num = 0;
+  for (uint32_t l = 0; l < KV_TIMER_LEVELS; l++)
+    for (uint32_t i = 0; i < KV_TIMER_SLOTS; i++)
+      LIST_INIT(&wheel->slots[l][i]);
+}
+
+// expires is at least the current tick, whose slot of level 0 is yet to be
+// processed when timers are cascaded.
+static void timer_place(struct kv_timer_wheel *wheel, struct kv_timer *timer,
+                        uint64_t expires) {
+  uint64_t delta = expires - wheel->now;
+  uint32_t l = 0;
+  while (l < KV_TIMER_LEVELS - 1 && delta >= LEVEL_SPAN(l))
+    l++;
+  // park it at the far end of the last level, it is placed again from there.
+  if (delta >= LEVEL_SPAN(l))
+    expires = wheel->now + LEVEL_SPAN(l) - 1;
+  uint32_t slot = (expires >> (KV_TIMER_BITS * l)) & SLOT_MASK;
+  LIST_INSERT_HEAD(&wheel->slots[l][slot], timer, entry);
+}
+
+void kv_timer_add(struct kv_timer_wheel *wheel, struct kv_timer *timer,
+                  uint64_t now, uint64_t expires) {
+  if (wheel->num == 0 && now > wheel->now)
+    wheel->now = now;
+  timer->expires = expires;
+  timer_place(wheel, timer, expires > wheel->now ? expires : wheel->now + 1);
+  wheel->num++;
+}
+
+void kv_timer_del(struct kv_timer_wheel *wheel, struct kv_timer *timer) {
+  if (!kv_timer_pending(timer))
+    return;
+  LIST_REMOVE(timer, entry);
+  timer->entry.le_prev = NULL;
+  wheel->num--;
+}
+
+// move the timers of a slot of level l down, once the ticks it spans are the
+// next ones.
+static void cascade(struct kv_timer_wheel *wheel, uint32_t l) {
+  uint32_t slot = (wheel->now >> (KV_TIMER_BITS * l)) & SLOT_MASK;
+  struct kv_timer_list list = wheel->slots[l][slot];
+  struct kv_timer *timer;
+  if ((timer = LIST_FIRST(&list)))
+    timer->entry.le_prev = &LIST_FIRST(&list);
+  LIST_INIT(&wheel->slots[l][slot]);
+  while ((timer = LIST_FIRST(&list))) {
+    LIST_REMOVE(timer, entry);
+    timer_place(wheel, timer, timer->expires);
+  }
+}
+
+void kv_timer_advance(struct kv_timer_wheel *wheel, uint64_t now,
+                      struct kv_timer_list *expired) {
+  if (wheel->num == 0 && now > wheel->now) {
+    wheel->now = now;
+    return;
+  }
+  while (wheel->now < now) {
+    wheel->now++;
+    // higher levels first, they may refill the slot of a lower one.
+    for (uint32_t l = KV_TIMER_LEVELS - 1; l > 0; l--)
+      if ((wheel->now & ((1ULL << (KV_TIMER_BITS * l)) - 1)) == 0)
+        cascade(wheel, l);
+    struct kv_timer_list *slot = &wheel->slots[0][wheel->now & SLOT_MASK];
+    struct kv_timer *timer;
+    while ((timer = LIST_FIRST(slot))) {
+      LIST_REMOVE(timer, entry);
+      LIST_INSERT_HEAD(expired, timer, entry);
+      wheel->num--;
+    }
+  }
+}
@@ -0,0 +1,54 @@
+#ifndef _KV_TIMER_H_
+#define _KV_TIMER_H_
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/queue.h>
+
+// hierarchical timing wheel. it has KV_TIMER_LEVELS levels of KV_TIMER_SLOTS
+// slots, and a slot of level l spans KV_TIMER_SLOTS^l ticks. adding and
+// removing a timer is O(1), and a timer moves down at most KV_TIMER_LEVELS - 1
+// times before it expires. timers farther away than the wheel spans are
+// parked in its last level. the wheel is not thread safe.
+#define KV_TIMER_BITS (6U)
+#define KV_TIMER_SLOTS (1U << KV_TIMER_BITS)
+#define KV_TIMER_LEVELS (4U)
+
+struct kv_timer {
+  uint64_t expires; // in ticks
+  LIST_ENTRY(kv_timer) entry;
+};
+LIST_HEAD(kv_timer_list, kv_timer);
+
+struct kv_timer_wheel {
+  uint64_t now; // the last tick processed
+  uint32_t num; // pending timers
+  struct kv_timer_list slots[KV_TIMER_LEVELS][KV_TIMER_SLOTS];
+};
+
+void kv_timer_wheel_init(struct kv_timer_wheel *wheel, uint64_t now);
+static inline void kv_timer_init(struct kv_timer *timer) {
+  timer->entry.le_prev = NULL;
+}
+static inline bool kv_timer_pending(struct kv_timer *timer) {
+  return timer->entry.le_prev != NULL;
+}
+// a timer already expired fires at the next tick. now is the current tick, an
+// empty wheel skips the ticks up to it at once instead of stepping through
+// them at the next advance.
+void kv_timer_add(struct kv_timer_wheel *wheel, struct kv_timer *timer,
+                  uint64_t now, uint64_t expires);
+void kv_timer_del(struct kv_timer_wheel *wheel, struct kv_timer *timer);
+// process the ticks up to now, the expired timers are moved to expired.
+void kv_timer_advance(struct kv_timer_wheel *wheel, uint64_t now,
+                      struct kv_timer_list *expired);
+// take the next timer of expired, it is no longer pending.
+static inline struct kv_timer *kv_timer_pop(struct kv_timer_list *expired) {
+  struct kv_timer *timer = LIST_FIRST(expired);
+  if (timer) {
+    LIST_REMOVE(timer, entry);
+    timer->entry.le_prev = NULL;
+  }
+  return timer;
+}
+#endif
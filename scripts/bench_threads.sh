@@ -0,0 +1,17 @@
+#!/bin/bash
+
+# run kv_rdma_bench with 1 to N threads against a server started with
+#   kv_rdma_bench <json_config> server <addr> <port> N
+# usage: scripts/bench_threads.sh <build_dir> <json_config> <addr> <port> N
+
+BUILD_DIR=$1
+CONFIG=$2
+ADDR=$3
+PORT=$4
+MAX_THREADS=${5:-4}
+
+for ((i = 1; i <= MAX_THREADS; i++)); do
+	printf "\n--- %d thread(s) ---\n" "$i"
+	$BUILD_DIR/kv_rdma_bench "$CONFIG" client "$ADDR" "$PORT" "$i" ||
+		exit
+done